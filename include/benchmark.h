@@ -0,0 +1,45 @@
+/*
+ * Cutoff latency benchmark, built only in the d1_mini_bench environment
+ * (BENCHMARK_MODE).  Instead of one long run, the firmware runs
+ * BENCH_CYCLES short ones back to back and times each phase of the
+ * timeout with micros():
+ *   relay   - deadline to the cutoff interrupt turning the relay off
+ *   detect  - deadline to loop() noticing the timeout
+ *   publish - deadline to the broker acknowledging the QoS 1 timeout
+ *             message (its PUBACK arriving), retransmits included
+ *   echo    - deadline to the broker sending the message back to us on
+ *             our subscription to the status topic
+ * Every other cycle the broker is made unreachable from the start of the
+ * run until BENCH_OUTAGE_MS after the deadline, so the notification numbers
+ * include a reconnect.  jitter() returns 0 in this build so the connect and
+ * publish jitter don't end up in the numbers.  When all the cycles are done
+ * a summary is published to the bench topic and printed on the serial port.
+ */
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#ifdef BENCHMARK_MODE
+
+#include <Arduino.h>
+#include "limiter.h"
+
+#ifndef BENCH_CYCLES
+#define BENCH_CYCLES 20             //runs to time, half of them with the broker unreachable
+#endif
+#define BENCH_RUNTIME_MS 3000       //length of each run
+#define BENCH_PAUSE_MS 2000         //relay off time between runs
+#define BENCH_OUTAGE_MS 5000        //broker stays unreachable this long after the deadline
+#define BENCH_ECHO_TIMEOUT_MS 90000 //give up waiting for the echo after this long
+#define BENCH_UNREACHABLE_BROKER "192.0.2.1" //TEST-NET-1, never routed
+#define MQTT_TOPIC_BENCH "bench"
+#define BENCH_MESSAGE_SIZE 60
+#define BENCH_SUMMARY_SIZE 400
+
+void benchBegin(const char* statusTopic, const char* resultTopic);
+void benchService(limiterState* limiter, uint64_t now, unsigned long cutoffMicros);
+void benchMessages(limiterMessages* messages);
+void benchEcho(const char* payload);
+bool benchBrokerBlocked();
+
+#endif
+#endif
@@ -0,0 +1,36 @@
+/*
+ * Boot validation after an OTA update.
+ *
+ * The ESP8266 has no second application slot to fall back to: the updater
+ * checks the image's MD5 and only copies it over the old one once it is
+ * complete, so a partial upload can't brick the device, but once the new
+ * image is in place it is the only one.  So a new image is put on
+ * probation instead.  It has to reach the broker within the otaValidate
+ * time.  If it doesn't it is restarted, up to BOOT_CHECK_ATTEMPTS times,
+ * and after that it stays up in safe mode with the relays off, listening
+ * for OTA so a good image can be pushed.  Reaching the broker at any point
+ * ends the probation.
+ *
+ * The record is in RTC memory, so a power cycle ends the probation too.
+ */
+#ifndef BOOT_CHECK_H
+#define BOOT_CHECK_H
+
+#include <stdint.h>
+
+#define BOOT_CHECK_MAGIC 0xB007
+#define BOOT_CHECK_ATTEMPTS 3  //boots a new image gets before safe mode
+
+typedef enum
+  {
+  BOOT_CHECK_NONE,      //nothing to do
+  BOOT_CHECK_RESTART,   //try the new image again, or leave safe mode
+  BOOT_CHECK_SAFE_MODE  //the image has used up its attempts
+  } bootCheckAction;
+
+void bootCheckFlashed();
+bool bootCheckBegin();
+bootCheckAction bootCheckService(uint64_t now, bool connected, uint32_t limitMs);
+bool bootCheckSafeMode();
+
+#endif
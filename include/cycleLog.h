@@ -0,0 +1,37 @@
+/*
+ * Power-on to power-on cycle log.  These devices are only powered while the
+ * load is running, so every boot is one cycle.  The log keeps the number of
+ * cycles and the lengths of the last CYCLE_HISTORY runs and of the off
+ * times between them.  Off times need the wall clock in both runs, so they
+ * come from SNTP and are unknown for a run that never got the time.
+ *
+ * If shortCycleOff is set, a cycle that starts less than that many seconds
+ * after the previous one ended is a short cycle.  When shortCycleCount of
+ * the logged cycles are short, one alert is published, at most once every
+ * CYCLE_ALERT_INTERVAL_S.  Nothing is published otherwise.
+ *
+ * The log is one small record in the settings log.  It is written at boot,
+ * when the clock is set, when a run times out, and as a run grows longer at
+ * 2, 4, 8, 16... seconds.  Short runs are timed closely and long ones take
+ * only a few writes.  A run's recorded length is the last of those
+ * checkpoints, so a long run can be logged as up to half its real length.
+ */
+#ifndef CYCLE_LOG_H
+#define CYCLE_LOG_H
+
+#include <stdint.h>
+
+#define CYCLE_HISTORY 8                 //runs kept in the log
+#define CYCLE_ALERT_INTERVAL_S 3600     //minimum time between short cycle alerts
+#define CYCLE_UNKNOWN 0xFFFF            //off time that couldn't be measured
+#define CYCLE_ALERT_SIZE 200
+#define MQTT_TOPIC_CYCLES "cycles"
+
+void cycleBegin(uint16_t shortOffSeconds, uint8_t shortCount);
+void cycleConfigure(uint16_t shortOffSeconds, uint8_t shortCount);
+void cycleUpdate(uint64_t now, bool running);
+void cycleRunEnded(uint64_t now);
+bool cyclePublishAlert(const char* topic);
+uint32_t cycleCount();
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * Duty cycle limiter: caps the total runtime within a sliding window, so a
+ * short-cycling load that never reaches maxRuntime still gets stopped.
+ *
+ * The window is split into DUTY_BUCKETS buckets, each holding the seconds
+ * of runtime in its slice of the window.  Time moves the window along one
+ * bucket at a time, dropping the oldest, so every update is O(1) and the
+ * window is accurate to one bucket width.
+ *
+ * The history lives in RTC memory so that a reset keeps it.  Because these
+ * devices are usually powered by the load, the history is also copied to the
+ * settings log every DUTY_CHECKPOINT_SECONDS of runtime and when a run
+ * times out.  Time spent powered off can't be measured, so it counts as no
+ * time at all.  That errs on the side of keeping the load off.
+ */
+#ifndef DUTY_CYCLE_H
+#define DUTY_CYCLE_H
+
+#include <stdint.h>
+
+#define DUTY_BUCKETS 24
+#define DUTY_MAGIC 0xD077
+#define DUTY_CHECKPOINT_SECONDS 60  //runtime between copies to flash
+#define DUTY_UNLIMITED 0xFFFFFFFF   //dutyRemaining() when the limiter is off
+
+void dutyBegin(uint32_t windowSeconds, uint32_t allowedSeconds);
+void dutyConfigure(uint32_t windowSeconds, uint32_t allowedSeconds);
+void dutyUpdate(uint64_t now, bool running);
+void dutyCheckpoint();
+uint32_t dutyUsed();
+uint32_t dutyRemaining();
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * Queue of things that happened while the broker couldn't hear about them.
+ *
+ * Events are stamped with the boot they happened in and the milliseconds
+ * since that boot, and kept in RTC memory so that a soft reset doesn't lose
+ * them.  Once SNTP has set the clock they get the wall clock time instead,
+ * and eventStamp() back-dates the ones from this boot that were logged
+ * before that.  Once the broker is connected they are published oldest first, one
+ * per call to eventDrain().  If the queue fills up the oldest event is
+ * dropped and the next one published says how many were lost.
+ */
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#include <stdint.h>
+
+#define EVENT_QUEUE_SIZE 16
+#define EVENT_QUEUE_MAGIC 0xE7E8
+#define EVENT_PAYLOAD_SIZE 100
+
+typedef enum
+  {
+  EVENT_START=1,   //powered up, relay on
+  EVENT_TIMEOUT,   //the runtime was used up and the relay turned off
+  EVENT_RECONNECT, //the broker connection came back after being lost
+  EVENT_CONFIG     //a setting was changed
+  } eventType;
+
+void eventBegin();
+void eventLog(uint8_t type);
+void eventStamp();
+bool eventDrain(const char* topic);
+uint16_t eventBootCount();
+
+#endif
@@ -0,0 +1,26 @@
+/*
+ * The few hardware services the limiter logic needs.  The firmware
+ * implements these in main.cpp on top of the Arduino core and the MQTT
+ * client; anything else (a test harness on the build machine, for one) can
+ * supply its own and link limiter.cpp without the rest of the firmware.
+ *
+ * Persistent storage goes through settingsStore.h, which is already
+ * independent of the hardware at its interface.
+ */
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+
+// The clock isn't here: the limiter is handed the time on every call, so
+// whoever drives it decides what time it is.
+
+void halSetRelay(uint8_t channel, bool on);
+void halSetLed(uint8_t channel, bool on);  // the warning LED, not the built-in one
+bool halConnected();      // true if the broker connection is up
+bool halCanPublish();     // and reports aren't being held back after connecting
+bool halPublish(const char* topic, const char* payload, bool retain);
+uint16_t halPublishReliable(const char* topic, const char* payload); // retained, QoS 1; returns 0 if it can't be sent now
+bool halDelivered(uint16_t id);  // the broker has acknowledged a halPublishReliable() message
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * The runtime limiter state machine: send the run message once the broker
+ * is reachable, turn the relay off when the deadline passes and then
+ * report the timeout.  It only talks to the hardware through hal.h.
+ */
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LIMITER_MESSAGE_SIZE 160    //longest status message after the template is filled in
+#define LIMITER_IDLE UINT64_MAX     //deadline while there is no run
+
+typedef struct
+  {
+  uint64_t deadline;          //now at which the runtime is up, myMillis() in the firmware
+  bool timedOut;
+  bool runMessagePending;     //the "started" message has not been sent yet
+  bool timeoutMessageSent;    //and the broker has acknowledged it
+  uint16_t timeoutPacket;     //ID of the timeout message while it waits for the broker, 0 before it's sent
+  uint8_t channel;            //which relay and LED, set once by the caller
+  } limiterState;
+
+// Fills in a message template, see templates.h.  Writes at most size bytes
+// including the terminating null and returns the length.  Supplied by the
+// caller so that the limiter doesn't need Print or the Arduino core.
+typedef size_t (*limiterRenderer)(char* buf, size_t size, const char* message, const void* context);
+
+// What to say and where.  The strings belong to the caller.  The messages
+// are templates, filled in by render when they are sent; with no renderer
+// they go out as they are.
+typedef struct
+  {
+  const char* statusTopic;
+  const char* runMessage;
+  const char* timeoutMessage;
+  bool notify;                //false if the settings aren't good enough to publish
+  limiterRenderer render;
+  const void* context;        //passed to render
+  } limiterMessages;
+
+void limiterStart(limiterState* state, uint64_t deadline);
+bool limiterService(limiterState* state, uint64_t now, bool cutoffFired, const limiterMessages* messages);
+void limiterStop(limiterState* state);
+bool limiterRunning(const limiterState* state);
+uint64_t limiterRemaining(const limiterState* state, uint64_t now);
+
+#endif
@@ -0,0 +1,45 @@
+/*
+ * QoS 1 publishing alongside PubSubClient, which can only publish at QoS 0.
+ *
+ * Messages are written to the broker connection as ready-made MQTT PUBLISH
+ * packets with a packet ID and kept in a fixed table of QOS1_INFLIGHT slots
+ * until the broker's PUBACK for that ID arrives.  Anything not acknowledged
+ * within QOS1_RETRY_MS, or still waiting when the connection comes back,
+ * is sent again with the DUP flag set.  A full table refuses new messages
+ * and the caller tries again later.
+ *
+ * PubSubClient ignores PUBACKs, so qos1Service() has to look at the
+ * incoming data before mqttClient.loop() does.  It only takes a PUBACK that
+ * is at the front of the stream.  If PubSubClient reads a PUBACK first, the
+ * message is simply sent again and acknowledged the second time.  Our
+ * packet IDs all have QOS1_PACKET_ID_BASE set, and PubSubClient numbers its
+ * SUBSCRIBEs from 1, so an acknowledgement of one is never taken for the
+ * other's.
+ *
+ * The packets bypass PubSubClient, so its idea of when it last sent
+ * something doesn't include them.  That only makes it send a PINGREQ a
+ * little sooner than it needs to; the broker counts our packets as
+ * activity, and the PINGRESP still goes to PubSubClient, so the keepalive
+ * holds either way.
+ */
+#ifndef MQTT_QOS1_H
+#define MQTT_QOS1_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include "runLimiter.h"
+#include "limiter.h"
+
+#define QOS1_INFLIGHT 2          //messages that can wait for a PUBACK at once
+#define QOS1_RETRY_MS 5000       //send again if there's no PUBACK in this long
+#define QOS1_PACKET_ID_BASE 0x8000 //set in every packet ID, PubSubClient's start from 1
+#define QOS1_TOPIC_SIZE TOPIC_BUFFER_SIZE
+#define QOS1_PAYLOAD_SIZE LIMITER_MESSAGE_SIZE
+
+void qos1Begin(WiFiClient& client);
+uint16_t qos1Publish(const char* topic, const char* payload, bool retain);
+bool qos1Delivered(uint16_t packetId);
+void qos1Service();
+void qos1Reconnected();
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * Lightweight loop profiler.
+ *
+ * Each stage of loop() is timed with the CPU cycle counter and the result
+ * is dropped into a histogram of power-of-two microsecond buckets, so the
+ * cost per measurement is a couple of register reads and an increment.
+ * The histogram gives the count, worst case and an upper bound on the 99th
+ * percentile for each stage without keeping individual samples.
+ *
+ * Usage:
+ *   uint32_t start=ESP.getCycleCount();
+ *   doSomething();
+ *   profileRecord(PROFILE_SOMETHING,start);
+ */
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <Arduino.h>
+
+#define PROFILE_BUCKETS 20  //bucket n holds times under 2^n microseconds, the last one everything longer
+
+typedef enum
+  {
+  PROFILE_LOOP,         //the whole pass through loop()
+  PROFILE_CONNECTION,   //connectionService()
+  PROFILE_MQTT,         //mqttClient.loop()
+  PROFILE_COMMAND,      //checkForCommand()
+  PROFILE_OTA,          //ArduinoOTA.handle()
+  PROFILE_WEB,          //webService()
+  PROFILE_CUTOFF,       //checking the timeout and turning off the relay
+  PROFILE_TASKS,        //runTasks()
+  PROFILE_STAGES
+  } profileStage;
+
+void profileRecord(uint8_t stage, uint32_t startCycles);
+void profileDump(Print& out);
+void profileReset();
+
+#endif
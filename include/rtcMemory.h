@@ -0,0 +1,23 @@
+/*
+ * Map of the RTC user memory, which keeps its contents through a reset or
+ * deep sleep but not through a power cycle.  Offsets are in 4-byte blocks.
+ * The first 128 bytes (blocks 0-31) are used by the OTA bootloader, so
+ * everything here starts at block 32.  There are 128 blocks in all.
+ */
+#ifndef RTC_MEMORY_H
+#define RTC_MEMORY_H
+
+#define RTC_BLOCK_SIZE 4
+#define RTC_FIRST_USER_BLOCK 32
+#define RTC_BLOCKS 128
+
+#define RTC_EVENTS_BLOCK RTC_FIRST_USER_BLOCK  //offline event queue, 38 blocks
+#define RTC_DUTY_BLOCK 76                       //duty cycle history, 18 blocks
+#define RTC_BOOT_CHECK_BLOCK 94                 //new image on probation, 2 blocks
+#define RTC_RUNTIME_BLOCK 96                    //runtime used so far by each channel, 10 blocks
+//Blocks 70-75 held the single channel runtime record.  They are left alone
+//so that going back to older firmware doesn't read something else there.
+
+#define RTC_BLOCKS_FOR(x) ((sizeof(x)+RTC_BLOCK_SIZE-1)/RTC_BLOCK_SIZE)
+
+#endif
@@ -1,3 +1,8 @@
+#ifndef RUN_LIMITER_H
+#define RUN_LIMITER_H
+
+#include "limiter.h"
+#include "templates.h"
 
 #define FLASH_LED true
 #define LED_ON LOW
@@ -6,42 +11,236 @@
 #define RELAY_OFF LOW
 #define RELAY_PORT 3 
 #define LED_PORT 0 
+
+// Channels.  Each one is a relay, a warning LED and a runtime limit of its
+// own; channel 1 is the original one on RELAY_PORT and LED_PORT.  Build with
+// -D CHANNEL_COUNT=n to use more on a board with the pins for them.
+#ifndef CHANNEL_COUNT
+#define CHANNEL_COUNT 1
+#endif
+#define CHANNEL_MAX 3
+#if CHANNEL_COUNT<1 || CHANNEL_COUNT>CHANNEL_MAX
+#error CHANNEL_COUNT must be 1 to CHANNEL_MAX
+#endif
+// GPIO15 (D8) has to be low at boot, so it drives a relay (off is low)
+// rather than reading a sense input that could hold it high.
+#ifndef CHANNEL_RELAY_PORTS
+#define CHANNEL_RELAY_PORTS {RELAY_PORT,5,15} //GPIO numbers, D1 and D8 on a D1 mini
+#endif
+#ifndef CHANNEL_LED_PORTS
+#define CHANNEL_LED_PORTS {LED_PORT,4,16}     //D2 and D0
+#endif
+#ifndef CHANNEL_SENSE_PORTS
+#define CHANNEL_SENSE_PORTS {13,14,12}        //D7, D5 and D6
+#endif
+#define NO_DEADLINE UINT64_MAX                //nearestRemaining() when every channel has timed out
+#define CUTOFF_TIMER_DIVIDER TIM_DIV16   //timer1 runs at 80MHz/16, 0.2us per tick
+#define CUTOFF_TIMER_TICKS_PER_MS 5000
+#define CUTOFF_TIMER_MAX_TICKS 0x7FFFFF  //timer1 counter is only 23 bits, about 1.6 seconds
 #define WIFI_CONNECTION_ATTEMPTS 15
+#define WIFI_CONNECT_TIMEOUT_MS (WIFI_CONNECTION_ATTEMPTS*500) //give up on an association attempt after this long
+#define CONNECT_BACKOFF_MIN_MS 1000   //first retry delay after a failed WiFi or MQTT connection
+#define CONNECT_BACKOFF_MAX_MS 60000  //retry delay doubles on each failure up to this
+#define CONNECT_JITTER_MS 3000        //first broker attempt is put off by up to this
+#define PUBLISH_JITTER_MS 3000        //and the first reports after connecting (not the status messages) by up to this
 #define VALID_SETTINGS_FLAG 0xDAB0
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+#define VALID_FAST_CONNECT_FLAG 0xFA57
+#define FAST_CONNECT_TIMEOUT_MS 3000 //fall back to a normal connect if the cached AP doesn't answer
 #define SSID_SIZE 100
 #define PASSWORD_SIZE 50
 #define ADDRESS_SIZE 30
 #define USERNAME_SIZE 50
 
-#define DEFAULT_MAX_RUNTIME_SECONDS 60*5
+#define DEFAULT_MAX_RUNTIME_SECONDS 300 //five minutes
+#define COMMAND_LINE_SIZE 200            //longest command accepted from the serial port
+#define CONSOLE_RX_BUFFER_SIZE 1024      //serial receive ring, enough for a pasted configuration
+#define MAX_TASKS 8                      //size of the periodic task table
+#define COUNTDOWN_INTERVAL_MS 5000       //debug countdown print rate
+#define LED_FLASH_INTERVAL_MS 250        //half second flash rate
+
+// Power saving.  loop() waits in delay() so the SDK can put the WiFi modem
+// (and for light sleep, the CPU) to sleep between passes.
+#define POWER_SAVE_OFF 0
+#define POWER_SAVE_MODEM 1
+#define POWER_SAVE_LIGHT 2
+#define POWER_SAVE_IDLE_MS 50            //longest wait per pass, sets the command response time
+#define POWER_SAVE_GUARD_MS 2000         //stay fully awake this close to the deadline
+#define POWER_ACTIVE_MA 70               //typical module current awake with WiFi on
+#define POWER_MODEM_SLEEP_MA 15          //typical current while idle in modem sleep
+#define POWER_LIGHT_SLEEP_MA 1           //typical current while idle in light sleep
+
+// Run sensing.  Normally a run is timed from power-up.  With runSense set,
+// each channel times the load from its sense input instead, so the device
+// can be permanently powered.
+#define RUN_SENSE_OFF 0
+#define RUN_SENSE_HIGH 1                 //load is on while the input is high, e.g. a current transformer and comparator
+#define RUN_SENSE_LOW 2                  //load is on while the input is low, e.g. a dry contact to ground
+#define SENSE_DEBOUNCE_US 20000          //edges this soon after the last one are bounce
 
 #define MQTT_CLIENTID_SIZE 25
 #define DEFAULT_MQTT_BROKER_PORT 1883
 #define MQTT_MAX_TOPIC_SIZE 50
-#define MQTT_MAX_MESSAGE_SIZE 15
+#define TOPIC_BUFFER_SIZE (MQTT_MAX_TOPIC_SIZE+20) //topic root plus the longest suffix we add
+#define MQTT_MAX_MESSAGE_SIZE 100 //status message templates, see messageResolver()
 #define DEFAULT_MQTT_TOPIC_ROOT "esp8266/runlimiter/"
 #define MQTT_CLIENT_ID_ROOT "RunTimeLimiter"
 #define MQTT_TOPIC_RSSI "rssi"
 #define MQTT_TOPIC_STATUS "status"
+#define MQTT_TOPIC_TELEMETRY "telemetry"
+#define MQTT_TOPIC_EVENT "event"
+#define TELEMETRY_PAYLOAD_SIZE 330
 #define DEFAULT_MQTT_RUN_MESSAGE "started"
 #define DEFAULT_MQTT_TIMEOUT_MESSAGE "timeout"
 #define DEFAULT_MQTT_LWT_MESSAGE "stopped"
 #define MQTT_TOPIC_COMMAND_REQUEST "command"
+#define MQTT_TOPIC_BATCH_RESPONSE "batch" //reply topic for multi-setting commands
+#define RSSI_PUBLISH_INTERVAL_MS 60000  //how often to publish the WiFi signal strength
+#define DEFAULT_OTA_VALIDATE_SECONDS 120 //a new image has this long to reach the broker
+#define OTA_PROGRESS_INTERVAL_MS 1000    //how often to print the upload progress
+#define OTA_PASSWORD_MIN_LENGTH 8        //shortest OTA password accepted, the same as WPA2
+#define MQTT_DNS_TIMEOUT_MS 250          //max time to wait for the broker address lookup
+#define MQTT_CONNECT_TIMEOUT_MS 250      //max time to wait for the TCP connection to the broker
+#define MQTT_SOCKET_TIMEOUT_SECONDS 1    //max time to wait for the broker to answer the connect
+
+// What we need to skip the scan and DHCP when reconnecting to the same AP.
+// It's filled in from the last successful connection.
+typedef struct
+  {
+  unsigned int valid=0; //VALID_FAST_CONNECT_FLAG if the rest is good
+  uint8_t bssid[6];
+  int32_t channel=0;
+  uint32_t ip=0;
+  uint32_t gateway=0;
+  uint32_t subnet=0;
+  uint32_t dns=0;
+  } fastConnectCache;
+
+// Everything loop() needs for one channel.  They are kept in one small
+// array so that servicing them is a single pass over it.
+typedef struct
+  {
+  limiterState limiter;
+  uint8_t relayPort;
+  uint8_t ledPort;
+  boolean ledState;    //next state for the flashing warning LED
+  uint8_t sensePort;
+  volatile bool senseOn;          //debounced sense input, true when the load is on
+  volatile bool senseChanged;     //set by the interrupt, cleared by senseService()
+  volatile uint32_t senseCycles;  //cycle count at the last accepted edge, for the debounce
+  volatile uint32_t senseMicros;  //micros() at the last accepted edge
+  uint64_t runStartMicros;        //when the current sensed run started
+  } channelState;
+
+// These are the settings that get stored in EEPROM.  They are all in one struct which
+// makes it easier to store and retrieve.
+typedef struct 
+  {
+  unsigned int validConfig=0; 
+  char ssid[SSID_SIZE] = "";
+  char wifiPassword[PASSWORD_SIZE] = "";
+  char brokerAddress[ADDRESS_SIZE]="";
+  int brokerPort=DEFAULT_MQTT_BROKER_PORT;
+  char mqttUsername[USERNAME_SIZE]="";
+  char mqttUserPassword[PASSWORD_SIZE]="";
+  char mqttTopicRoot[MQTT_MAX_TOPIC_SIZE]="";
+  char mqttRunMessage[MQTT_MAX_MESSAGE_SIZE]="";
+  char mqttTimeoutMessage[MQTT_MAX_MESSAGE_SIZE]="";
+  char mqttLWTMessage[MQTT_MAX_MESSAGE_SIZE]="";
+  unsigned int maxRuntime=DEFAULT_MAX_RUNTIME_SECONDS; //seconds to run before timeout
+  boolean debug=false;
+  char mqttClientId[MQTT_CLIENTID_SIZE]=""; //will be the same across reboots
+  boolean fastConnect=false; //reconnect using the cached AP and address below
+  fastConnectCache fastCache;
+  unsigned int telemetryInterval=0; //seconds between telemetry reports, 0 for none
+  unsigned int dutyWindow=0;  //seconds in the duty cycle window, 0 for no duty cycle limit
+  unsigned int dutyAllowed=0; //seconds of runtime allowed in the window
+  unsigned int shortCycleOff=0;   //off time in seconds below which a cycle is short, 0 for no alerts
+  unsigned int shortCycleCount=3; //short cycles among the logged ones that raise an alert
+  unsigned int powerSave=POWER_SAVE_OFF; //POWER_SAVE_xxx
+  unsigned int maxRuntime2=DEFAULT_MAX_RUNTIME_SECONDS; //runtime limits for the other channels
+  unsigned int maxRuntime3=DEFAULT_MAX_RUNTIME_SECONDS;
+  unsigned int runSense=RUN_SENSE_OFF; //RUN_SENSE_xxx
+  char ntpServer[ADDRESS_SIZE]="";     //for the timestamps, empty for none
+  char otaPassword[PASSWORD_SIZE]="";  //or its MD5, empty to use the WiFi password
+  unsigned int otaValidate=DEFAULT_OTA_VALIDATE_SECONDS; //0 for no boot check
+  char mqttGroupTopic[MQTT_MAX_TOPIC_SIZE]=""; //full topic, empty for none
+  } conf;
+
+// One entry in the settings schema table
+typedef enum
+  {
+  FIELD_STRING,
+  FIELD_INT,
+  FIELD_UINT,
+  FIELD_BOOL,
+  FIELD_BLOB    //saved but not shown or settable
+  } fieldType;
+
+#define FIELD_CLEARS_FAST_CACHE 0x01 //changing it invalidates the fast connect information
+#define FIELD_READ_ONLY         0x02 //shown but can't be set by a command
+#define FIELD_HIDDEN            0x04 //internal, not shown or settable
+#define FIELD_SECRET            0x08 //a password, not shown on the web page
+#define FIELD_ADDS_SLASH        0x10 //a '/' is added to the end, not counted in maximum
+#define FIELD_UNIT_ONLY         0x20 //can't be set from the group topic, it could cut every unit off
+
+typedef struct
+  {
+  uint8_t id;                //saved under this number, never reuse one
+  const char* name;          //the name used in commands (in flash)
+  const char* help;          //description for showSettings() (in flash)
+  uint8_t type;              //fieldType
+  uint16_t offset;           //where it is in the conf struct
+  uint16_t size;             //bytes it takes in the conf struct
+  int32_t minimum;           //smallest value, or shortest string for a complete configuration
+  int32_t maximum;           //largest value, or longest string that fits
+  const char* defaultValue;  //text for the factory default (in flash), NULL for zero
+  uint8_t flags;
+  } settingField;
 
 //prototypes
 void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length);
-unsigned long myMillis();
-bool processCommand(String cmd);
+uint64_t myMillis();
+void dumpSettings(Print& out);
+boolean publishProfile(const char* topic);
+boolean publishSettings(const char* topic);
+int processBatch(char* cmd, char* resp, size_t respSize);
+boolean commitStaged(const conf* staged, int count, char* resp, size_t respSize);
+const char* adminPassword();
 void checkForCommand();
-bool connectToWiFi();
+void connectionService(uint64_t now);
+void jitterBegin();
+unsigned long jitter(unsigned long range);
+void startWiFi();
+void updateFastConnectCache();
 void showSettings();
-void reconnect(); 
-void showSub(char* topic, bool subgood);
+char* generateMqttClientId(char* mqttId);
+boolean reconnect(); 
+void showSub(const char* topic, bool subgood);
+void buildTopics();
+const char* replyTopic(const char* suffix, size_t length);
 void initializeSettings();
 void loadSettings();
 bool saveSettings();
+bool commitSettings();
 void incomingData(); 
+void armCutoffTimer(int channel, unsigned long ms);
+void stopCutoffTimer(int channel);
+void senseBegin(uint64_t now);
+void senseService(uint64_t now);
+uint64_t nearestRemaining(uint64_t now);
+unsigned int channelMaxRuntime(int channel);
+uint64_t channelUsed(int channel, uint64_t now);
+int addTask(void (*callback)(uint64_t now), unsigned long period, unsigned long firstDelay);
+void triggerTask(int id, uint64_t at);
+void setTaskPeriod(int id, unsigned long period);
+void noteStackDepth();
+void runTasks(uint64_t now);
+void powerSaveIdle(uint64_t now);
+void messageResolver(Print& out, const char* key, const void* context);
+size_t renderMessage(char* buf, size_t size, const char* message, const void* context);
 void setup(); 
 void loop();
 
-
+#endif
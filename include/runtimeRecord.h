@@ -0,0 +1,29 @@
+/*
+ * How much of the runtime each channel has used, kept in RTC memory so
+ * that a watchdog reset, crash or brownout in the middle of a run doesn't
+ * hand out a fresh maxRuntime.  Only a real power cycle (which clears the
+ * RTC memory) or the reset and factorydefaults commands start the budget
+ * over.
+ *
+ * The record is rewritten every RUNTIME_SAVE_INTERVAL_MS, which costs a
+ * few microseconds and no flash wear.
+ */
+#ifndef RUNTIME_RECORD_H
+#define RUNTIME_RECORD_H
+
+#include <stdint.h>
+
+#define RUNTIME_RECORD_MAGIC 0x7E12
+#define RUNTIME_SAVE_INTERVAL_MS 1000 //at most this much runtime is lost in a reset
+#define RUNTIME_CHANNELS 3            //channels with a record, at least CHANNEL_MAX
+
+bool runtimeBegin();
+uint64_t runtimeUsed(int channel);
+bool runtimeExhausted(int channel);
+uint16_t runtimeResets();
+uint32_t runtimeResetReason();
+void runtimeSave(int channel, uint64_t used, bool timedOut);
+void runtimeRestart(int channel);
+void runtimeClear();
+
+#endif
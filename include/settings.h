@@ -0,0 +1,34 @@
+/*
+ * The settings table and everything that works on the settings by name:
+ * commands, batches, defaults, validation and packing them for the flash
+ * log.  Apart from the factorydefaults and reset commands nothing here
+ * touches the hardware, so it builds on its own for the tests in test/.
+ */
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <Arduino.h>
+#include "runLimiter.h"
+
+#define SETTING_FIELD_MAX 40 //fields settingsRecord has room for
+#define SETTINGS_RECORD_SIZE (sizeof(conf)+2*SETTING_FIELD_MAX)
+
+extern uint8_t settingsRecord[SETTINGS_RECORD_SIZE]; //settings as saved in flash
+
+void getSettingField(size_t index, settingField* field);
+size_t settingCount();
+boolean findSetting(const char* nme, settingField* field);
+void printSettingValue(Print& out, const settingField* field, const conf* source);
+boolean storeSetting(conf* target, const settingField* field, const char* val);
+boolean applySetting(conf* target, const char* nme, const char* val);
+char* trim(char* str);
+boolean isBatchCommand(const char* cmd);
+boolean isGroupCommand(const char* cmd);
+int applyJsonBatch(conf* target, char* p, const char** badName);
+bool processCommand(char* cmd, unsigned int length);
+void initializeDefaults();
+boolean settingsComplete(const conf* s);
+size_t packSettings(const conf* source);
+void unpackSettings(conf* target, size_t length);
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * Wear-levelled record store for settings and other data that has to
+ * survive a power cycle.
+ *
+ * Records are appended to a log that spans STORE_SECTORS flash sectors.
+ * Each record has a type, a sequence number and a CRC, and the newest
+ * good record of each type wins.  A sector is only erased when the log
+ * moves on to it, at which point the newest record of every type is copied
+ * forward, wherever it is, so a power cut part way through a compaction
+ * still leaves the newest copy of each record readable.  Compared with
+ * EEPROM.commit(), which erases its sector on every write, this cuts the
+ * erase count by the number of records that fit in a sector.
+ *
+ * The log lives at the start of the filesystem area, which this firmware
+ * doesn't otherwise use.  If the linker script doesn't leave enough room
+ * there storeBegin() returns false and the caller should use EEPROM instead.
+ */
+#ifndef SETTINGS_STORE_H
+#define SETTINGS_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STORE_SECTORS 4           //flash sectors used by the log
+#define STORE_MAGIC 0x5E77        //marks the start of a record
+#define STORE_MAX_TYPES 5         //record types are 1 through STORE_MAX_TYPES-1
+#define STORE_COMMIT_DELAY_MS 500 //settings changes are written this long after the last one
+
+#define STORE_RECORD_SETTINGS 1   //the whole conf struct, as written by older firmware
+#define STORE_RECORD_SETTINGS_FIELDS 2 //the settings, field by field
+#define STORE_RECORD_DUTY 3       //duty cycle history
+#define STORE_RECORD_CYCLES 4     //power cycle log
+
+bool storeBegin();
+size_t storeRead(uint8_t type, void* data, size_t size);
+bool storeWrite(uint8_t type, const void* data, size_t size);
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * Template substitution shared by the MQTT messages, the serial port and
+ * the web pages.
+ *
+ * A template is plain text with {key} placeholders.  It is copied out in a
+ * single pass and each placeholder is replaced by whatever the resolver
+ * prints for its key, so nothing is allocated and nothing is copied twice.
+ * A brace that isn't followed by a key of at most TEMPLATE_KEY_SIZE
+ * characters and a closing brace is copied as it is.  A key the resolver
+ * doesn't know comes out as nothing.
+ *
+ * Output goes to any Print, or through bufferPrint into a fixed-size
+ * buffer that is never overrun.
+ */
+#ifndef TEMPLATES_H
+#define TEMPLATES_H
+
+#include <Arduino.h>
+
+#define TEMPLATE_KEY_SIZE 16
+
+// Prints the value of one placeholder.  context is whatever was passed to
+// renderTemplate().
+typedef void (*templateResolver)(Print& out, const char* key, const void* context);
+
+void renderTemplate(Print& out, const char* tpl, templateResolver resolve, const void* context);
+void renderTemplate_P(Print& out, PGM_P tpl, templateResolver resolve, const void* context);
+size_t renderTemplate(char* buf, size_t size, const char* tpl, templateResolver resolve, const void* context);
+
+// A Print into a fixed buffer, always null terminated.  What doesn't fit is
+// dropped and overflowed() says so.
+class bufferPrint: public Print
+  {
+  public:
+    bufferPrint(char* buf, size_t size): _buf(buf), _size(size), _len(0), _overflow(false)
+      {
+      if (_size>0)
+        _buf[0]=0;
+      }
+    size_t write(uint8_t c) override
+      {
+      if (_len+1>=_size)
+        {
+        _overflow=true;
+        return 0;
+        }
+      _buf[_len++]=c;
+      _buf[_len]=0;
+      return 1;
+      }
+    size_t length() const {return _len;}
+    bool overflowed() const {return _overflow;}
+  private:
+    char* _buf;
+    size_t _size;
+    size_t _len;
+    bool _overflow;
+  };
+
+#endif
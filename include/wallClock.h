@@ -0,0 +1,23 @@
+/*
+ * Wall clock time from SNTP, for timestamping what gets published.
+ *
+ * clockBegin() is called once WiFi is up.  configTime() only starts the
+ * SNTP client, which sets the clock in the background, so nothing waits
+ * for it and the first messages go out without a timestamp.  clockService()
+ * notices when the time arrives so that anything recorded before then can
+ * be back-dated from the millisecond clock.
+ */
+#ifndef WALL_CLOCK_H
+#define WALL_CLOCK_H
+
+#include <stdint.h>
+
+#define DEFAULT_NTP_SERVER "pool.ntp.org"
+#define CLOCK_VALID_EPOCH 1600000000UL //earlier than this and SNTP hasn't set the clock yet
+
+void clockBegin(const char* server);
+bool clockService();
+bool clockValid();
+uint64_t clockNowMs();
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * Local web page for status and settings, so the device can be checked and
+ * configured when the broker is down.
+ *
+ *   GET  /          status
+ *   GET  /settings  form built from the settings table
+ *   POST /settings  apply the form, all or nothing.  Needs HTTP basic auth
+ *                   with user WEB_USER and adminPassword().  Without one
+ *                   the form is read-only.
+ *
+ * Pages are PROGMEM templates (see templates.h).  They are filled in as
+ * they are sent, in chunks of WEB_CHUNK_SIZE using chunked transfer
+ * encoding, so no page is ever held in RAM.
+ */
+#ifndef WEB_SERVER_H
+#define WEB_SERVER_H
+
+#define WEB_PORT 80
+#define WEB_USER "admin"
+#define WEB_CHUNK_SIZE 128     //bytes sent per chunk
+
+void webBegin();
+void webService();
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * Cutoff latency benchmark.  See benchmark.h.
+ */
+#ifdef BENCHMARK_MODE
+
+#include <Arduino.h>
+#include <PubSubClient.h>
+
+#include "runLimiter.h"
+#include "hal.h"
+#include "templates.h"
+#include "benchmark.h"
+
+extern PubSubClient mqttClient;
+
+typedef enum
+  {
+  BENCH_WAITING,   //for the first broker connection
+  BENCH_RUNNING,   //relay on, waiting for the deadline
+  BENCH_NOTIFYING, //timed out, waiting for the echo
+  BENCH_PAUSED,    //between runs
+  BENCH_DONE
+  } benchPhase;
+
+typedef enum
+  {
+  BENCH_RELAY,
+  BENCH_DETECT,
+  BENCH_PUBLISH,
+  BENCH_ECHO,
+  BENCH_METRICS
+  } benchMetric;
+
+typedef struct
+  {
+  uint32_t count;
+  long minimum;
+  long maximum;
+  int64_t total;
+  } benchStat;
+
+static benchStat results[2][BENCH_METRICS]; //[broker blocked][metric], microseconds
+static uint32_t missedEchoes[2];
+
+static benchPhase phase=BENCH_WAITING;
+static int cycle=0;
+static bool unreachable=false;     //this cycle runs with the broker unreachable
+static bool outage=false;          //and the broker is unreachable right now
+static uint64_t phaseStart=0;       //myMillis() time the phase started
+static unsigned long deadlineMicros=0;
+static bool relayTimed=false;
+static bool detected=false;
+static bool published=false;
+static bool echoed=false;
+static unsigned long publishMicros=0; //when loop() saw the PUBACK
+static unsigned long echoMicros=0;    //when the echo arrived
+static const limiterState* benchLimiter; //the channel being timed
+static const char* statusTopic;
+static const char* resultTopic;
+static char runMessage[BENCH_MESSAGE_SIZE];
+static char timeoutMessage[BENCH_MESSAGE_SIZE];
+
+static void addResult(benchMetric metric, unsigned long at)
+  {
+  benchStat* stat=&results[unreachable][metric];
+  long elapsed=(long)(at-deadlineMicros); //can be a little negative if the timer rounds down
+  if (stat->count==0 || elapsed<stat->minimum)
+    stat->minimum=elapsed;
+  if (stat->count==0 || elapsed>stat->maximum)
+    stat->maximum=elapsed;
+  stat->total+=elapsed;
+  stat->count++;
+  }
+
+void benchBegin(const char* status, const char* result)
+  {
+  statusTopic=status;
+  resultTopic=result;
+  memset(results,0,sizeof(results));
+  memset(missedEchoes,0,sizeof(missedEchoes));
+  Serial.print(F("Benchmark mode, "));
+  Serial.print(BENCH_CYCLES);
+  Serial.println(F(" cycles once the broker is connected."));
+  }
+
+static void startCycle(limiterState* limiter, uint64_t now)
+  {
+  unreachable=cycle%2==1;
+  outage=unreachable;
+  if (outage && mqttClient.connected())
+    mqttClient.disconnect(); //and reconnect() won't get it back until the outage is over
+  snprintf(runMessage,sizeof(runMessage),"bench %d run",cycle);
+  snprintf(timeoutMessage,sizeof(timeoutMessage),"bench %d timeout",cycle);
+  relayTimed=detected=published=echoed=false;
+  benchLimiter=limiter;
+
+  halSetLed(limiter->channel,false);
+  halSetRelay(limiter->channel,true);
+  limiterStart(limiter,now+BENCH_RUNTIME_MS);
+  deadlineMicros=micros()+BENCH_RUNTIME_MS*1000UL;
+  armCutoffTimer(limiter->channel,BENCH_RUNTIME_MS);
+  phase=BENCH_RUNNING;
+  phaseStart=now;
+  }
+
+static void printStat(Print& out, const benchStat* stat)
+  {
+  out.print('[');
+  out.print(stat->count);
+  if (stat->count>0)
+    {
+    out.print(',');
+    out.print(stat->minimum);
+    out.print(',');
+    out.print((long)(stat->total/stat->count));
+    out.print(',');
+    out.print(stat->maximum);
+    }
+  out.print(']');
+  }
+
+/*
+ * {"cycles":n,"reachable":{...},"unreachable":{...}} where each metric is
+ * [count,min,avg,max] in microseconds after the deadline.
+ */
+static void printSummary(Print& out)
+  {
+  static const char* const metricNames[BENCH_METRICS]={"relay","detect","publish","echo"};
+  out.print(F("{\"cycles\":"));
+  out.print(cycle);
+  for (int b=0;b<2;b++)
+    {
+    out.print(b==0?F(",\"reachable\":{"):F(",\"unreachable\":{"));
+    for (int m=0;m<BENCH_METRICS;m++)
+      {
+      out.print('"');
+      out.print(metricNames[m]);
+      out.print(F("\":"));
+      printStat(out,&results[b][m]);
+      out.print(',');
+      }
+    out.print(F("\"missed\":"));
+    out.print(missedEchoes[b]);
+    out.print('}');
+    }
+  out.print('}');
+  }
+
+static void finish()
+  {
+  static char summary[BENCH_SUMMARY_SIZE];
+  bufferPrint out(summary,sizeof(summary));
+  printSummary(out);
+  Serial.println(summary);
+  if (!halPublish(resultTopic,summary,true)) //retain so the result survives until it's collected
+    Serial.println(F("************ Failed publishing benchmark results!"));
+  phase=BENCH_DONE;
+  }
+
+/*
+ * Add the notification results for the cycle, once both are in or it has
+ * given up on them.
+ */
+static void closeCycle()
+  {
+  if (published)
+    addResult(BENCH_PUBLISH,publishMicros);
+  if (echoed)
+    addResult(BENCH_ECHO,echoMicros);
+  else
+    missedEchoes[unreachable]++;
+  }
+
+/*
+ * Call from every pass through loop(), after limiterService().
+ */
+void benchService(limiterState* limiter, uint64_t now, unsigned long cutoffMicros)
+  {
+  switch (phase)
+    {
+    case BENCH_WAITING:
+      if (halCanPublish())
+        startCycle(limiter,now);
+      break;
+
+    case BENCH_RUNNING:
+    case BENCH_NOTIFYING:
+      if (cutoffMicros!=0 && !relayTimed)
+        {
+        relayTimed=true;
+        addResult(BENCH_RELAY,cutoffMicros);
+        }
+      if (limiter->timedOut && !detected)
+        {
+        detected=true;
+        addResult(BENCH_DETECT,micros());
+        phase=BENCH_NOTIFYING;
+        phaseStart=now;
+        }
+      if (limiter->timeoutMessageSent && !published)
+        {
+        published=true;
+        publishMicros=micros();
+        }
+      if (outage && phase==BENCH_NOTIFYING && now-phaseStart>=BENCH_OUTAGE_MS)
+        outage=false; //let reconnect() through
+      if (phase==BENCH_NOTIFYING && ((echoed && published) || now-phaseStart>=BENCH_ECHO_TIMEOUT_MS))
+        {
+        closeCycle();
+        outage=false;
+        cycle++;
+        phase=BENCH_PAUSED;
+        phaseStart=now;
+        }
+      break;
+
+    case BENCH_PAUSED:
+      if (now-phaseStart>=BENCH_PAUSE_MS)
+        {
+        if (cycle>=BENCH_CYCLES)
+          finish();
+        else if (halCanPublish() || cycle%2==1)
+          startCycle(limiter,now);
+        }
+      break;
+
+    case BENCH_DONE:
+      break;
+    }
+  }
+
+/*
+ * Put the cycle number into the messages so the echo can't be confused
+ * with a retained copy from an earlier cycle.
+ */
+void benchMessages(limiterMessages* messages)
+  {
+  messages->runMessage=runMessage;
+  messages->timeoutMessage=timeoutMessage;
+  }
+
+/*
+ * Something arrived on the status topic.  This is called from
+ * mqttClient.loop(), after qos1Service() has read any PUBACK in the same
+ * pass but before benchService() has looked at it, so a PUBACK that is
+ * already in is timed here too rather than after the echo.
+ */
+void benchEcho(const char* payload)
+  {
+  if (phase==BENCH_NOTIFYING && !echoed && strcmp(payload,timeoutMessage)==0)
+    {
+    echoed=true;
+    echoMicros=micros();
+    if (!published && benchLimiter->timeoutPacket!=0 && halDelivered(benchLimiter->timeoutPacket))
+      {
+      published=true;
+      publishMicros=echoMicros;
+      }
+    }
+  }
+
+/*
+ * True while reconnect() should be pointed at a broker that isn't there.
+ */
+bool benchBrokerBlocked()
+  {
+  return outage;
+  }
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Boot validation after an OTA update.  See bootCheck.h.
+ */
+#include <Arduino.h>
+#include <coredecls.h>
+
+#include "rtcMemory.h"
+#include "bootCheck.h"
+
+typedef struct
+  {
+  uint16_t magic;      //BOOT_CHECK_MAGIC while a new image is on probation
+  uint8_t attempts;    //boots of the new image so far
+  uint8_t reserved;
+  uint32_t crc;        //crc32 of everything above
+  } bootCheckStore;
+
+static bootCheckStore record;
+static bool probation=false;
+static bool safeMode=false;
+
+static void saveRecord()
+  {
+  record.crc=crc32(&record,offsetof(bootCheckStore,crc));
+  ESP.rtcUserMemoryWrite(RTC_BOOT_CHECK_BLOCK,(uint32_t*)&record,sizeof(record));
+  }
+
+/*
+ * The OTA update is complete.  Put the new image on probation.
+ */
+void bootCheckFlashed()
+  {
+  memset(&record,0,sizeof(record));
+  record.magic=BOOT_CHECK_MAGIC;
+  saveRecord();
+  }
+
+/*
+ * Count this boot against the new image, if there is one on probation.
+ * Returns true if there is.
+ */
+bool bootCheckBegin()
+  {
+  probation=ESP.rtcUserMemoryRead(RTC_BOOT_CHECK_BLOCK,(uint32_t*)&record,sizeof(record))
+            && record.magic==BOOT_CHECK_MAGIC
+            && record.crc==crc32(&record,offsetof(bootCheckStore,crc));
+  if (!probation)
+    return false;
+  if (record.attempts<255)
+    record.attempts++;
+  saveRecord();
+  return true;
+  }
+
+/*
+ * Call from every pass through loop() with whether the broker is connected.
+ * limitMs is how long the image has to get there, 0 for no check.
+ */
+bootCheckAction bootCheckService(uint64_t now, bool connected, uint32_t limitMs)
+  {
+  if (!probation)
+    return BOOT_CHECK_NONE;
+  if (connected || limitMs==0)
+    {
+    probation=false;
+    record.magic=0;
+    saveRecord();
+    return safeMode?BOOT_CHECK_RESTART:BOOT_CHECK_NONE; //start over in normal mode
+    }
+  if (safeMode || now<limitMs)
+    return BOOT_CHECK_NONE;
+  if (record.attempts<BOOT_CHECK_ATTEMPTS)
+    return BOOT_CHECK_RESTART;
+  safeMode=true;
+  return BOOT_CHECK_SAFE_MODE;
+  }
+
+bool bootCheckSafeMode()
+  {
+  return safeMode;
+  }
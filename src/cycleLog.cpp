@@ -0,0 +1,168 @@
+/*
+ * Cycle log and short cycle alerts.  See cycleLog.h.
+ */
+#include <Arduino.h>
+
+#include "settingsStore.h"
+#include "hal.h"
+#include "cycleLog.h"
+#include "wallClock.h"
+
+typedef struct __attribute__((packed))
+  {
+  uint32_t count;                 //boots seen
+  uint32_t runStart;              //epoch time the current run started, 0 if unknown
+  uint32_t runSeconds;            //length of the current run at the last checkpoint
+  uint32_t lastAlert;             //epoch time of the last short cycle alert
+  uint16_t runOff;                //off time before the current run, seconds
+  uint16_t runs[CYCLE_HISTORY];   //earlier runs, seconds, newest at head-1
+  uint16_t offs[CYCLE_HISTORY];   //off time before each of them, seconds
+  uint8_t head;                   //where the next one goes
+  uint8_t used;                   //how many of runs[] are filled in
+  } cycleRecord;
+
+static cycleRecord cycles;
+static uint32_t previousEnd=0;    //epoch time the previous run ended, 0 if unknown
+static uint32_t nextCheckpoint=2; //runtime seconds at which to write the log again
+static bool clockSeen=false;
+static bool alertPending=false;
+static uint16_t shortOff=0;
+static uint8_t shortWanted=0;
+
+static void saveLog()
+  {
+  storeWrite(STORE_RECORD_CYCLES,&cycles,sizeof(cycles));
+  }
+
+static uint16_t clampSeconds(uint32_t seconds)
+  {
+  return seconds<CYCLE_UNKNOWN?seconds:CYCLE_UNKNOWN-1;
+  }
+
+static uint8_t shortCycles()
+  {
+  uint8_t count=0;
+  if (cycles.runOff<shortOff)
+    count++;
+  for (uint8_t i=0;i<cycles.used;i++)
+    {
+    if (cycles.offs[i]<shortOff)
+      count++;
+    }
+  return count;
+  }
+
+/*
+ * See whether it's time to complain.  Needs the clock for the rate limit.
+ */
+static void checkShortCycling(uint32_t epoch)
+  {
+  if (shortOff==0 || shortWanted==0 || alertPending)
+    return;
+  if (shortCycles()>=shortWanted && epoch-cycles.lastAlert>=CYCLE_ALERT_INTERVAL_S)
+    {
+    cycles.lastAlert=epoch;
+    alertPending=true;
+    saveLog();
+    }
+  }
+
+/*
+ * Count this boot and move the previous run into the history.
+ */
+void cycleBegin(uint16_t shortOffSeconds, uint8_t shortCount)
+  {
+  shortOff=shortOffSeconds;
+  shortWanted=shortCount;
+  if (storeRead(STORE_RECORD_CYCLES,&cycles,sizeof(cycles))!=sizeof(cycles)
+      || cycles.head>=CYCLE_HISTORY || cycles.used>CYCLE_HISTORY)
+    memset(&cycles,0,sizeof(cycles));
+  else if (cycles.count>0)
+    {
+    cycles.runs[cycles.head]=clampSeconds(cycles.runSeconds);
+    cycles.offs[cycles.head]=cycles.runOff;
+    cycles.head=(cycles.head+1)%CYCLE_HISTORY;
+    if (cycles.used<CYCLE_HISTORY)
+      cycles.used++;
+    if (cycles.runStart!=0)
+      previousEnd=cycles.runStart+cycles.runSeconds;
+    }
+  cycles.count++;
+  cycles.runStart=0;
+  cycles.runSeconds=0;
+  cycles.runOff=CYCLE_UNKNOWN;
+  saveLog();
+  }
+
+void cycleConfigure(uint16_t shortOffSeconds, uint8_t shortCount)
+  {
+  shortOff=shortOffSeconds;
+  shortWanted=shortCount;
+  }
+
+/*
+ * Call about once a second.  now is milliseconds since boot.
+ */
+void cycleUpdate(uint64_t now, bool running)
+  {
+  if (!clockSeen && clockValid())
+    {
+    //the clock just got set, work out when this run started
+    clockSeen=true;
+    uint32_t epoch=clockNowMs()/1000;
+    cycles.runStart=epoch-now/1000;
+    if (previousEnd!=0 && cycles.runStart>previousEnd)
+      cycles.runOff=clampSeconds(cycles.runStart-previousEnd);
+    saveLog();
+    checkShortCycling(epoch);
+    }
+
+  if (running && now/1000>=nextCheckpoint)
+    {
+    cycles.runSeconds=now/1000;
+    nextCheckpoint*=2;
+    saveLog();
+    }
+  }
+
+/*
+ * The run timed out, so its length is known exactly.
+ */
+void cycleRunEnded(uint64_t now)
+  {
+  cycles.runSeconds=now/1000;
+  nextCheckpoint=0xFFFFFFFF; //no more runtime to record
+  saveLog();
+  }
+
+/*
+ * Publish the short cycle alert if one is due.  Returns true if there was
+ * nothing to send or it went out.
+ */
+bool cyclePublishAlert(const char* topic)
+  {
+  if (!alertPending)
+    return true;
+  if (!halCanPublish())
+    return false;
+
+  char payload[CYCLE_ALERT_SIZE];
+  int len=snprintf(payload,sizeof(payload),"{\"ts\":%llu,\"cycles\":%lu,\"shortCycles\":%u,\"runs\":[",
+                   (unsigned long long)clockNowMs(),(unsigned long)cycles.count,shortCycles());
+  for (uint8_t i=0;i<cycles.used && len<(int)sizeof(payload);i++) //newest first
+    {
+    uint8_t slot=(cycles.head+CYCLE_HISTORY-1-i)%CYCLE_HISTORY;
+    len+=snprintf(payload+len,sizeof(payload)-len,"%s[%u,%d]",i==0?"":",",
+                  cycles.runs[slot],cycles.offs[slot]==CYCLE_UNKNOWN?-1:cycles.offs[slot]);
+    }
+  if (len<(int)sizeof(payload))
+    snprintf(payload+len,sizeof(payload)-len,"],\"off\":%d}",cycles.runOff==CYCLE_UNKNOWN?-1:cycles.runOff);
+
+  alertPending=!halPublish(topic,payload,false);
+  return !alertPending;
+  }
+
+uint32_t cycleCount()
+  {
+  return cycles.count;
+  }
@@ -0,0 +1,154 @@
+/*
+ * Duty cycle limiter.  See dutyCycle.h.
+ */
+#include <Arduino.h>
+#include <coredecls.h>
+
+#include "rtcMemory.h"
+#include "settingsStore.h"
+#include "dutyCycle.h"
+
+typedef struct
+  {
+  uint16_t magic;          //DUTY_MAGIC
+  uint8_t bucket;          //the one being filled now
+  uint8_t reserved;
+  uint32_t window;         //window length the history was built for, seconds
+  uint32_t bucketElapsed;  //seconds spent in the current bucket so far
+  uint32_t total;          //sum of the buckets
+  uint16_t sinceCheckpoint; //runtime seconds since the last copy to flash
+  uint16_t buckets[DUTY_BUCKETS]; //runtime seconds in each slice
+  uint16_t reserved2;
+  uint32_t crc;            //crc32 of everything above
+  } dutyHistory;
+
+static dutyHistory history;
+static uint32_t allowed=0;   //seconds of runtime allowed in the window
+static uint64_t lastUpdate=0; //milliseconds since boot of the last dutyUpdate()
+
+static uint32_t historyCrc()
+  {
+  return crc32(&history,offsetof(dutyHistory,crc));
+  }
+
+static bool historyIsGood()
+  {
+  return history.magic==DUTY_MAGIC
+         && history.bucket<DUTY_BUCKETS
+         && history.crc==historyCrc();
+  }
+
+static void saveHistory()
+  {
+  history.crc=historyCrc();
+  ESP.rtcUserMemoryWrite(RTC_DUTY_BLOCK,(uint32_t*)&history,sizeof(history));
+  }
+
+static void clearHistory(uint32_t windowSeconds)
+  {
+  memset(&history,0,sizeof(history));
+  history.magic=DUTY_MAGIC;
+  history.window=windowSeconds;
+  }
+
+/*
+ * Pick up the history from RTC memory, or from flash after a power cycle.
+ * A history built for a different window length is thrown away.
+ */
+void dutyBegin(uint32_t windowSeconds, uint32_t allowedSeconds)
+  {
+  allowed=allowedSeconds;
+  bool good=ESP.rtcUserMemoryRead(RTC_DUTY_BLOCK,(uint32_t*)&history,sizeof(history)) && historyIsGood();
+  if (!good)
+    good=storeRead(STORE_RECORD_DUTY,&history,sizeof(history))==sizeof(history) && historyIsGood();
+  if (!good || history.window!=windowSeconds)
+    clearHistory(windowSeconds);
+  saveHistory();
+  }
+
+/*
+ * The window or allowance setting changed.
+ */
+void dutyConfigure(uint32_t windowSeconds, uint32_t allowedSeconds)
+  {
+  allowed=allowedSeconds;
+  if (history.magic==DUTY_MAGIC && history.window!=windowSeconds) //not before dutyBegin()
+    {
+    clearHistory(windowSeconds);
+    saveHistory();
+    }
+  }
+
+/*
+ * Call about once a second.  now is milliseconds since boot and running
+ * says whether the relay has been on since the last call.
+ */
+void dutyUpdate(uint64_t now, bool running)
+  {
+  uint32_t seconds=(now-lastUpdate)/1000;
+  lastUpdate+=seconds*1000ULL; //keep the fraction for next time
+  if (history.window==0 || seconds==0)
+    return;
+
+  uint32_t width=history.window/DUTY_BUCKETS;
+  if (width==0)
+    width=1;
+  while (seconds>0)
+    {
+    uint32_t step=width-history.bucketElapsed; //seconds until the next bucket
+    if (step>seconds)
+      step=seconds;
+    if (running)
+      {
+      uint32_t room=0xFFFF-history.buckets[history.bucket];
+      uint32_t add=step<room?step:room;
+      history.buckets[history.bucket]+=add;
+      history.total+=add;
+      history.sinceCheckpoint+=step;
+      }
+    history.bucketElapsed+=step;
+    seconds-=step;
+    if (history.bucketElapsed>=width)
+      {
+      //move on and forget the oldest slice
+      history.bucket=(history.bucket+1)%DUTY_BUCKETS;
+      history.total-=history.buckets[history.bucket];
+      history.buckets[history.bucket]=0;
+      history.bucketElapsed=0;
+      }
+    }
+  saveHistory();
+  if (history.sinceCheckpoint>=DUTY_CHECKPOINT_SECONDS)
+    dutyCheckpoint();
+  }
+
+/*
+ * Copy the history to flash so it survives losing power.
+ */
+void dutyCheckpoint()
+  {
+  if (history.window==0)
+    return;
+  history.sinceCheckpoint=0;
+  saveHistory();
+  storeWrite(STORE_RECORD_DUTY,&history,sizeof(history));
+  }
+
+/*
+ * Seconds of runtime in the window.
+ */
+uint32_t dutyUsed()
+  {
+  return history.total;
+  }
+
+/*
+ * Seconds of runtime left in the window, or DUTY_UNLIMITED if there is
+ * no duty cycle limit.
+ */
+uint32_t dutyRemaining()
+  {
+  if (history.window==0 || allowed==0)
+    return DUTY_UNLIMITED;
+  return history.total<allowed?allowed-history.total:0;
+  }
@@ -0,0 +1,181 @@
+/*
+ * Offline event queue.  See eventQueue.h.
+ */
+#include <Arduino.h>
+#include <coredecls.h>
+
+#include "rtcMemory.h"
+#include "hal.h"
+#include "eventQueue.h"
+#include "wallClock.h"
+
+#define EVENT_STAMPED 0x01 //at is milliseconds after epochBase instead of since the boot
+
+typedef struct
+  {
+  uint32_t at;       //milliseconds since the boot it happened in
+  uint16_t boot;     //eventBootCount() when it happened
+  uint8_t type;      //eventType
+  uint8_t flags;     //EVENT_STAMPED
+  } queuedEvent;
+
+typedef struct
+  {
+  uint16_t magic;    //EVENT_QUEUE_MAGIC
+  uint16_t boot;     //goes up by one on each reset, starts over after power off
+  uint8_t head;      //index of the oldest event
+  uint8_t count;
+  uint16_t dropped;  //events lost to a full queue since the last publish
+  uint64_t epochBase; //wall clock milliseconds the stamped events count from, 0 if none
+  queuedEvent events[EVENT_QUEUE_SIZE];
+  uint32_t crc;      //crc32 of everything above
+  } eventStore;
+
+static eventStore queue;
+
+static const char* const eventNames[]={"","start","timeout","reconnect","config"};
+
+static void saveQueue()
+  {
+  queue.crc=crc32(&queue,offsetof(eventStore,crc));
+  ESP.rtcUserMemoryWrite(RTC_EVENTS_BLOCK,(uint32_t*)&queue,sizeof(queue));
+  }
+
+/*
+ * Move epochBase back to epochMs, adding the difference to the events
+ * already stamped so that they keep their times.  False, and nothing is
+ * changed, if one of them would no longer fit.
+ */
+static bool lowerEpochBase(uint64_t epochMs)
+  {
+  uint64_t shift=queue.epochBase-epochMs;
+  for (int i=0;i<queue.count;i++)
+    {
+    const queuedEvent* event=&queue.events[(queue.head+i)%EVENT_QUEUE_SIZE];
+    if ((event->flags&EVENT_STAMPED) && event->at+shift>0xFFFFFFFF)
+      return false;
+    }
+  for (int i=0;i<queue.count;i++)
+    {
+    queuedEvent* event=&queue.events[(queue.head+i)%EVENT_QUEUE_SIZE];
+    if (event->flags&EVENT_STAMPED)
+      event->at+=shift;
+    }
+  queue.epochBase=epochMs;
+  return true;
+  }
+
+/*
+ * Give an event its wall clock time.
+ */
+static void stampEvent(queuedEvent* event, uint64_t epochMs)
+  {
+  if (queue.epochBase==0)
+    queue.epochBase=epochMs;
+  else if (epochMs<queue.epochBase && !lowerEpochBase(epochMs))
+    return; //SNTP moved the clock a long way back, leave it as boot time
+  uint64_t offset=epochMs-queue.epochBase;
+  if (offset>0xFFFFFFFF)
+    return; //more than 49 days after the oldest, leave it as boot time
+  event->at=offset;
+  event->flags|=EVENT_STAMPED;
+  }
+
+/*
+ * Pick up whatever was queued before the reset.  After a power cycle the
+ * RTC memory is garbage and the queue starts out empty.
+ */
+void eventBegin()
+  {
+  if (!ESP.rtcUserMemoryRead(RTC_EVENTS_BLOCK,(uint32_t*)&queue,sizeof(queue))
+      || queue.magic!=EVENT_QUEUE_MAGIC
+      || queue.count>EVENT_QUEUE_SIZE
+      || queue.head>=EVENT_QUEUE_SIZE
+      || queue.crc!=crc32(&queue,offsetof(eventStore,crc)))
+    {
+    memset(&queue,0,sizeof(queue));
+    queue.magic=EVENT_QUEUE_MAGIC;
+    }
+  else
+    queue.boot++;
+  saveQueue();
+  }
+
+uint16_t eventBootCount()
+  {
+  return queue.boot;
+  }
+
+/*
+ * Add an event, pushing out the oldest one if there's no room.
+ */
+void eventLog(uint8_t type)
+  {
+  if (queue.count==EVENT_QUEUE_SIZE)
+    {
+    queue.head=(queue.head+1)%EVENT_QUEUE_SIZE;
+    queue.count--;
+    queue.dropped++;
+    }
+  queuedEvent* event=&queue.events[(queue.head+queue.count)%EVENT_QUEUE_SIZE];
+  event->at=millis();
+  event->boot=queue.boot;
+  event->type=type;
+  event->flags=0;
+  if (clockValid())
+    stampEvent(event,clockNowMs());
+  queue.count++;
+  saveQueue();
+  }
+
+/*
+ * The clock has just been set.  Work out the wall clock time of the events
+ * logged earlier in this boot from how long ago they happened.  Events from
+ * earlier boots can't be placed and keep their boot time.
+ */
+void eventStamp()
+  {
+  uint64_t epochNow=clockNowMs();
+  uint32_t ms=millis();
+  for (int i=0;i<queue.count;i++)
+    {
+    queuedEvent* event=&queue.events[(queue.head+i)%EVENT_QUEUE_SIZE];
+    if (event->boot==queue.boot && (event->flags&EVENT_STAMPED)==0)
+      stampEvent(event,epochNow-(uint32_t)(ms-event->at));
+    }
+  saveQueue();
+  }
+
+/*
+ * Publish the oldest event, if there is one and the broker is there to
+ * take it.  Returns true if there are more to send.
+ */
+bool eventDrain(const char* topic)
+  {
+  if (queue.count==0 || !halCanPublish())
+    return false;
+
+  const queuedEvent* event=&queue.events[queue.head];
+  char payload[EVENT_PAYLOAD_SIZE];
+  int len=snprintf(payload,sizeof(payload),"{\"event\":\"%s\",\"boot\":%u",
+           event->type<sizeof(eventNames)/sizeof(eventNames[0])?eventNames[event->type]:"unknown",
+           event->boot);
+  if (event->flags&EVENT_STAMPED)
+    len+=snprintf(payload+len,sizeof(payload)-len,",\"ts\":%llu",(unsigned long long)(queue.epochBase+event->at));
+  else
+    len+=snprintf(payload+len,sizeof(payload)-len,",\"at\":%lu",(unsigned long)event->at);
+  if (queue.dropped>0)
+    len+=snprintf(payload+len,sizeof(payload)-len,",\"dropped\":%u",queue.dropped);
+  snprintf(payload+len,sizeof(payload)-len,"}");
+
+  if (!halPublish(topic,payload,false))
+    return true; //try again next time
+
+  queue.head=(queue.head+1)%EVENT_QUEUE_SIZE;
+  queue.count--;
+  queue.dropped=0;
+  if (queue.count==0)
+    queue.epochBase=0; //the next stamped event starts a new base
+  saveQueue();
+  return queue.count>0;
+  }
@@ -0,0 +1,88 @@
+/*
+ * Runtime limiter state machine.  See limiter.h.
+ */
+#include "hal.h"
+#include "limiter.h"
+
+/*
+ * Fill in a message template and publish it retained at QoS 1.  Returns the
+ * packet ID, or 0 if it couldn't be sent.
+ */
+static uint16_t sendMessage(const limiterMessages* messages, const char* message)
+  {
+  if (messages->render==NULL)
+    return halPublishReliable(messages->statusTopic,message);
+  char payload[LIMITER_MESSAGE_SIZE];
+  messages->render(payload,sizeof(payload),message,messages->context);
+  return halPublishReliable(messages->statusTopic,payload);
+  }
+
+/*
+ * Start a run that ends at the given time.  The run message is sent on the
+ * next service call that finds the broker connected.
+ */
+void limiterStart(limiterState* state, uint64_t deadline)
+  {
+  state->deadline=deadline;
+  state->timedOut=false;
+  state->runMessagePending=true;
+  state->timeoutMessageSent=false;
+  state->timeoutPacket=0;
+  }
+
+/*
+ * The load stopped by itself before the deadline.  Go idle until the next
+ * limiterStart().
+ */
+void limiterStop(limiterState* state)
+  {
+  state->deadline=LIMITER_IDLE;
+  state->timedOut=false;
+  state->runMessagePending=false;
+  state->timeoutMessageSent=false;
+  state->timeoutPacket=0;
+  }
+
+/*
+ * True while a run is being timed.
+ */
+bool limiterRunning(const limiterState* state)
+  {
+  return !state->timedOut && state->deadline!=LIMITER_IDLE;
+  }
+
+/*
+ * Call this from every pass through loop().  cutoffFired is true if the
+ * cutoff timer has already turned the relay off.  Returns true on the pass
+ * that first sees the timeout.
+ */
+bool limiterService(limiterState* state, uint64_t now, bool cutoffFired, const limiterMessages* messages)
+  {
+  bool wasTimedOut=state->timedOut;
+  if (state->runMessagePending && halConnected()) //status messages don't wait for the publish hold
+    state->runMessagePending=sendMessage(messages,messages->runMessage)==0; //running!
+
+  state->timedOut=cutoffFired || now>=state->deadline;
+
+  if (state->timedOut && !state->timeoutMessageSent)
+    {
+    halSetRelay(state->channel,false); //turn off the device (the timer should already have done it)
+    halSetLed(state->channel,true);    //turn on the failure LED
+    if (state->timeoutPacket!=0)
+      state->timeoutMessageSent=halDelivered(state->timeoutPacket);
+    else if (messages->notify && !state->runMessagePending && halConnected())
+      state->timeoutPacket=sendMessage(messages,messages->timeoutMessage);
+    }
+  return state->timedOut && !wasTimedOut;
+  }
+
+/*
+ * Milliseconds left in the run, zero once it has timed out or if there is
+ * no run.
+ */
+uint64_t limiterRemaining(const limiterState* state, uint64_t now)
+  {
+  if (!limiterRunning(state) || now>=state->deadline)
+    return 0;
+  return state->deadline-now;
+  }
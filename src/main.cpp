@@ -39,44 +39,196 @@
 #include <pgmspace.h>
 #include <WiFiUdp.h>
 #include <ArduinoOTA.h>
+#include <coredecls.h>
 
 #include "runLimiter.h"
+#include "settingsStore.h"
+#include "settings.h"
+#include "profiler.h"
+#include "hal.h"
+#include "limiter.h"
+#include "benchmark.h"
+#include "eventQueue.h"
+#include "runtimeRecord.h"
+#include "dutyCycle.h"
+#include "cycleLog.h"
+#include "webServer.h"
+#include "templates.h"
+#include "mqttQos1.h"
+#include "wallClock.h"
+#include "bootCheck.h"
+
+#if CHANNEL_MAX>RUNTIME_CHANNELS
+#error The runtime record needs room for CHANNEL_MAX channels
+#endif
 
 //#define PRECONFIGURE //uncomment this to allow initial configuration via serial on ESP-01s
 
 char *stack_start;// initial stack size
+size_t maxStackDepth=0; // deepest stack seen by noteStackDepth()
 
 WiFiClient wifiClient;
 PubSubClient mqttClient(wifiClient);
 
-// These are the settings that get stored in EEPROM.  They are all in one struct which
-// makes it easier to store and retrieve.
+conf settings; //all settings in one struct makes it easier to store in EEPROM
+
+// The layout of the settings struct as written by older firmware, either
+// to EEPROM or as a whole-struct record in the settings log.  Only used to
+// bring those settings forward.
 typedef struct 
   {
-  unsigned int validConfig=0; 
-  char ssid[SSID_SIZE] = "";
-  char wifiPassword[PASSWORD_SIZE] = "";
-  char brokerAddress[ADDRESS_SIZE]="";
-  int brokerPort=DEFAULT_MQTT_BROKER_PORT;
-  char mqttUsername[USERNAME_SIZE]="";
-  char mqttUserPassword[PASSWORD_SIZE]="";
-  char mqttTopicRoot[MQTT_MAX_TOPIC_SIZE]="";
-  char mqttRunMessage[MQTT_MAX_MESSAGE_SIZE]="";
-  char mqttTimeoutMessage[MQTT_MAX_MESSAGE_SIZE]="";
-  char mqttLWTMessage[MQTT_MAX_MESSAGE_SIZE]="";
-  unsigned int maxRuntime=DEFAULT_MAX_RUNTIME_SECONDS; //seconds to run before timeout
-  boolean debug=false;
-  char mqttClientId[MQTT_CLIENTID_SIZE]=""; //will be the same across reboots
-  } conf;
+  unsigned int validConfig; 
+  char ssid[100];
+  char wifiPassword[50];
+  char brokerAddress[30];
+  int brokerPort;
+  char mqttUsername[50];
+  char mqttUserPassword[50];
+  char mqttTopicRoot[50];
+  char mqttRunMessage[15];
+  char mqttTimeoutMessage[15];
+  char mqttLWTMessage[15];
+  unsigned int maxRuntime;
+  boolean debug;
+  char mqttClientId[25];
+  boolean fastConnect; //not in EEPROM from the original firmware
+  fastConnectCache fastCache;
+  } legacyConf;
+
+// The full topic names, built once whenever the topic root changes
+// so that publishing doesn't have to.  The will topic is the status topic
+// of the first channel.
+typedef struct
+  {
+  char status[CHANNEL_COUNT][TOPIC_BUFFER_SIZE]; //status, status2, status3
+  char rssi[TOPIC_BUFFER_SIZE];
+  char command[TOPIC_BUFFER_SIZE];
+  char telemetry[TOPIC_BUFFER_SIZE];
+  char event[TOPIC_BUFFER_SIZE];
+  char cycles[TOPIC_BUFFER_SIZE];
+  char reply[TOPIC_BUFFER_SIZE]; //starts with the root, replyTopic() fills in the rest
+  size_t rootLength;
+  } topicCache;
+
+topicCache topics;
 
-conf settings; //all settings in one struct makes it easier to store in EEPROM
 boolean settingsAreValid=false;
+boolean settingsDirty=false;   //settings have changed but haven't been written to flash yet
+uint64_t settingsCommitTime=0; //myMillis() time to write them
+boolean useSettingsLog=false;  //settings are kept in the flash log instead of EEPROM
 
-String commandString = "";     // a String to hold incoming commands from serial
+char commandLine[COMMAND_LINE_SIZE]; // holds the incoming command from serial
+unsigned int commandLength=0;        // number of characters in commandLine
 bool commandComplete = false;  // goes true when enter is pressed
-
-unsigned long timeoutCount=0; //milliseconds
-boolean timeoutMessageSent=false;
+bool commandOverflow = false;  // the line was longer than commandLine, throw it away
+
+channelState channels[CHANNEL_COUNT]; //where each channel is in its run
+
+// The relays are turned off by a timer1 interrupt so that the cutoff happens on 
+// time no matter what loop() is doing.  There is only the one timer, so it is
+// always loaded for the earliest deadline.  Timer1 can only count about 1.6
+// seconds so the interval is handed to it in pieces.
+volatile uint32_t cutoffPiece=0;                  //timer1 ticks in the current piece, 0 if it's stopped
+volatile uint64_t cutoffTicksLeft[CHANNEL_COUNT]; //ticks from the start of the current piece to each cutoff, 0 for none
+volatile uint32_t cutoffFired=0;                  //bit per channel, set by the interrupt when it has turned the relay off
+
+// Run sensing, see senseBegin().  Fixed at boot.
+boolean senseEnabled=false;
+volatile bool senseActiveHigh=true;
+volatile uint32_t senseDebounceCycles=0;
+#ifdef BENCHMARK_MODE
+volatile unsigned long cutoffMicros=0; //micros() when the interrupt turned the relay off
+#endif
+
+// Periodic tasks.  Each one runs once per period from loop().  The time of the
+// earliest pending task is kept so that loop() only does one comparison
+// when nothing is due.
+typedef struct
+  {
+  void (*callback)(uint64_t now);
+  unsigned long period;   //milliseconds between runs
+  uint64_t nextRun;       //myMillis() time when it's due next
+  } periodicTask;
+
+periodicTask tasks[MAX_TASKS];
+int taskCount=0;
+uint64_t nextTaskRun=0; //earliest nextRun of all the tasks
+int rssiTask=-1;
+int telemetryTask=-1;
+unsigned long loopCount=0;      //passes through loop() since the last telemetry report
+unsigned int mqttConnectCount=0;   //successful broker connections since boot
+uint64_t idleMicros=0;             //time spent waiting in powerSaveIdle() since the last telemetry report
+
+// States for the connection manager.  connectionService() is called from loop()
+// and moves the connection along one step at a time so that nothing there
+// has to wait for WiFi or the broker.
+typedef enum
+  {
+  CONN_WIFI_DOWN,       //not associated, waiting for the retry delay to expire
+  CONN_WIFI_CONNECTING, //WiFi.begin() was called, waiting for association
+  CONN_MQTT_DOWN,       //WiFi is up, waiting for the retry delay to expire
+  CONN_MQTT_CONNECTED   //everything is up
+  } connState;
+
+connState connectionState=CONN_WIFI_DOWN;
+uint64_t connectionTimer=0;      //myMillis() when the current state or retry delay started
+unsigned long wifiBackoff=0;     //milliseconds to wait before the next WiFi attempt
+unsigned long mqttBackoff=0;     //milliseconds to wait before the next MQTT attempt
+uint64_t publishHoldUntil=0;     //myMillis() time before which reports wait after connecting
+uint32_t jitterState=1;          //xorshift state for jitter(), different on every unit
+boolean otaStarted=false;
+boolean otaEnabled=false;        //otaSetup() found a password to use
+boolean fastConnectAttempt=false; //the current WiFi attempt is using the cached AP and address
+
+// A Print that only counts what is written to it.  Used to find out how
+// long a message will be before streaming it.
+class countingPrint: public Print
+  {
+  public:
+    countingPrint(): _count(0) {}
+    size_t write(uint8_t c) override
+      {
+      _count++;
+      return 1;
+      }
+    size_t write(const uint8_t* buf, size_t size) override
+      {
+      _count+=size;
+      return size;
+      }
+    size_t count()
+      {
+      return _count;
+      }
+  private:
+    size_t _count;
+  };
+
+// A Print that collects small writes into a little buffer and passes them on
+// in pieces, so a stream of single characters doesn't turn into one network
+// write per character.  Call flush() when done.
+class chunkedPrint: public Print
+  {
+  public:
+    chunkedPrint(Print& out): _out(out), _len(0) {}
+    size_t write(uint8_t c) override
+      {
+      _buf[_len++]=c;
+      if (_len==sizeof(_buf))
+        flush();
+      return 1;
+      }
+    void flush() override
+      {
+      if (_len>0)
+        _out.write(_buf,_len);
+      _len=0;
+      }
+  private:
+    Print& _out;
+    uint8_t _buf[32];
+    size_t _len;
+  };
 
 void printStackSize(char id)
   {
@@ -84,25 +236,393 @@ void printStackSize(char id)
   Serial.print(id);
   Serial.print (F(": stack size "));
   Serial.println (stack_start - &stack);
+  noteStackDepth();
   }
 
-char* fixup(char* rawString, const char* field, const char* value)
+/*
+ * Keep track of the deepest the stack has been.  Call it from places
+ * that are likely to be deep.
+ */
+void noteStackDepth()
   {
-  String rs=String(rawString);
-  rs.replace(field,String(value));
-  strcpy(rawString,rs.c_str());
-  printStackSize('F');
-  return rawString;
+  char stack;
+  size_t depth=stack_start - &stack;
+  if (depth>maxStackDepth)
+    maxStackDepth=depth;
+  }
+
+/*
+ * Load timer1 with the next piece: up to the nearest cutoff, or as much of
+ * it as the timer can count.  Stops the timer if no channel is waiting.
+ */
+static void IRAM_ATTR loadCutoffPiece()
+  {
+  uint64_t next=0;
+  for (int i=0;i<CHANNEL_COUNT;i++)
+    if (cutoffTicksLeft[i]!=0 && (next==0 || cutoffTicksLeft[i]<next))
+      next=cutoffTicksLeft[i];
+  if (next==0)
+    {
+    cutoffPiece=0;
+    timer1_disable();
+    return;
+    }
+  cutoffPiece=next>CUTOFF_TIMER_MAX_TICKS?CUTOFF_TIMER_MAX_TICKS:next;
+  timer1_write(cutoffPiece);
+  }
+
+/*
+ * Timer1 interrupt handler.  Count the piece that just ended off every
+ * waiting channel, turn off the relays that have reached zero and load the
+ * next piece.  This has to stay in IRAM and can't touch anything in flash.
+ */
+void IRAM_ATTR cutoffTimerISR()
+  {
+  for (int i=0;i<CHANNEL_COUNT;i++)
+    {
+    if (cutoffTicksLeft[i]==0)
+      continue;
+    cutoffTicksLeft[i]-=cutoffPiece;
+    if (cutoffTicksLeft[i]==0)
+      {
+      if (RELAY_OFF==LOW)
+        GPOC=1<<channels[i].relayPort; //turn off the device
+      else
+        GPOS=1<<channels[i].relayPort;
+      cutoffFired|=1<<i;
+      #ifdef BENCHMARK_MODE
+      if (i==0)
+        cutoffMicros=micros();
+      #endif
+      }
+    }
+  loadCutoffPiece();
+  }
+
+/*
+ * Stop timer1 and move the counts, which are from the start of the current
+ * piece, up to now.  Call with interrupts off.
+ */
+static void pauseCutoffTimer()
+  {
+  timer1_disable();
+  if (cutoffPiece==0)
+    return;
+  uint32_t left=T1V;
+  uint32_t elapsed=left<cutoffPiece?cutoffPiece-left:cutoffPiece;
+  for (int i=0;i<CHANNEL_COUNT;i++)
+    if (cutoffTicksLeft[i]!=0)
+      cutoffTicksLeft[i]=cutoffTicksLeft[i]>elapsed?cutoffTicksLeft[i]-elapsed:1;
+  }
+
+/*
+ * Start the hardware timer that will turn off a channel's relay after the
+ * given number of milliseconds.  The other channels keep their deadlines.
+ */
+void armCutoffTimer(int channel, unsigned long ms)
+  {
+  uint64_t ticks=(uint64_t)ms*CUTOFF_TIMER_TICKS_PER_MS;
+  if (ticks==0)
+    ticks=1; //timer can't be loaded with zero
+  noInterrupts(); //the interrupt mustn't see the counts half moved
+  pauseCutoffTimer();
+  cutoffTicksLeft[channel]=ticks;
+  cutoffFired&=~(1<<channel);
+  #ifdef BENCHMARK_MODE
+  if (channel==0)
+    cutoffMicros=0;
+  #endif
+  timer1_attachInterrupt(cutoffTimerISR);
+  timer1_enable(CUTOFF_TIMER_DIVIDER, TIM_EDGE, TIM_SINGLE);
+  loadCutoffPiece();
+  interrupts();
+  }
+
+/*
+ * Cancel a channel's cutoff.  The other channels keep their deadlines.
+ */
+void stopCutoffTimer(int channel)
+  {
+  noInterrupts();
+  pauseCutoffTimer();
+  cutoffTicksLeft[channel]=0;
+  cutoffFired&=~(1<<channel);
+  loadCutoffPiece();
+  interrupts();
+  }
+
+/*
+ * Sense input interrupt handler.  The first edge after a quiet spell is
+ * taken and anything within SENSE_DEBOUNCE_US of it is bounce.  The time
+ * is kept so loop() can time the run from the edge itself.  This has to
+ * stay in IRAM and can't touch anything in flash.
+ */
+void IRAM_ATTR senseISR(void* arg)
+  {
+  channelState* ch=(channelState*)arg;
+  uint32_t cycles=ESP.getCycleCount();
+  if (cycles-ch->senseCycles<senseDebounceCycles)
+    return; //still bouncing
+  bool on=((GPI>>ch->sensePort)&1)==(senseActiveHigh?1:0);
+  if (on==ch->senseOn)
+    return;
+  ch->senseOn=on;
+  ch->senseCycles=cycles;
+  ch->senseMicros=micros();
+  ch->senseChanged=true;
+  }
+
+/*
+ * Time the channels from their sense inputs instead of from power-up.  The
+ * relays are turned on and each channel waits for its load to come on.  A
+ * channel that had timed out before a reset stays off, and one that was
+ * part way through a run only gets what was left of it.
+ */
+void senseBegin(uint64_t now)
+  {
+  static const uint8_t sensePorts[CHANNEL_MAX]=CHANNEL_SENSE_PORTS;
+  senseEnabled=true;
+  senseActiveHigh=settings.runSense==RUN_SENSE_HIGH;
+  senseDebounceCycles=SENSE_DEBOUNCE_US*ESP.getCpuFreqMHz();
+  for (int i=0;i<CHANNEL_COUNT;i++)
+    {
+    channelState* ch=&channels[i];
+    ch->sensePort=sensePorts[i];
+    ch->senseOn=false;
+    ch->senseChanged=false;
+    ch->senseCycles=ESP.getCycleCount()-senseDebounceCycles;
+    if (runtimeExhausted(i))
+      limiterStart(&ch->limiter,0); //times out on the first service call, relay stays off
+    else
+      {
+      limiterStop(&ch->limiter);
+      halSetRelay(i,true); //it stays on until a run times out
+      }
+    pinMode(ch->sensePort,senseActiveHigh?INPUT:INPUT_PULLUP);
+    attachInterruptArg(digitalPinToInterrupt(ch->sensePort),senseISR,ch,CHANGE);
+    }
+  senseService(now); //a load that is already on starts its run now
+  for (int i=0;i<CHANNEL_COUNT;i++)
+    {
+    if (!runtimeExhausted(i) && !limiterRunning(&channels[i].limiter))
+      runtimeRestart(i); //the run ended during the reset
+    }
+  }
+
+/*
+ * Milliseconds of runtime a sensed run on the channel gets, less anything
+ * the run used before a reset.
+ */
+static uint64_t senseBudget(int channel)
+  {
+  uint64_t budget=(uint64_t)channelMaxRuntime(channel)*1000;
+  budget=budget>runtimeUsed(channel)?budget-runtimeUsed(channel):0;
+  if (channel==0 && dutyRemaining()!=DUTY_UNLIMITED && dutyRemaining()*1000ULL<budget)
+    budget=dutyRemaining()*1000ULL; //the duty cycle limit is for the first channel
+  return budget;
+  }
+
+/*
+ * Start timing a channel on the rising edge of its sense input and stop
+ * on the falling edge, so it is ready for the next run without a reboot.
+ * Runs are timed from the edge, not from when loop() gets here.  A channel
+ * that times out stays off until the device is reset, the same as when
+ * timing from power-up.
+ */
+void senseService(uint64_t now)
+  {
+  if (!senseEnabled)
+    return;
+  for (int i=0;i<CHANNEL_COUNT;i++)
+    {
+    channelState* ch=&channels[i];
+    if (!ch->senseChanged)
+      {
+      //An edge can be lost in light sleep or inside the debounce time, so
+      //catch up with the pin once it has been quiet for a while.
+      bool on=digitalRead(ch->sensePort)==(senseActiveHigh?HIGH:LOW);
+      if (on==ch->senseOn || ESP.getCycleCount()-ch->senseCycles<senseDebounceCycles)
+        continue;
+      noInterrupts();
+      ch->senseOn=on;
+      ch->senseCycles=ESP.getCycleCount();
+      ch->senseMicros=micros();
+      interrupts();
+      }
+    noInterrupts();
+    bool on=ch->senseOn;
+    uint32_t age=micros()-ch->senseMicros; //how long ago the edge was
+    ch->senseChanged=false;
+    interrupts();
+
+    uint64_t edgeMicros=micros64()-age;
+    if (on && !limiterRunning(&ch->limiter) && !ch->limiter.timedOut)
+      {
+      uint64_t start=now>age/1000?now-age/1000:0;
+      ch->runStartMicros=edgeMicros;
+      limiterStart(&ch->limiter,start+senseBudget(i));
+      armCutoffTimer(i,limiterRemaining(&ch->limiter,now));
+      }
+    else if (!on && limiterRunning(&ch->limiter))
+      {
+      stopCutoffTimer(i);
+      limiterStop(&ch->limiter);
+      runtimeRestart(i);
+      if (settings.debug)
+        {
+        Serial.print(F("Channel "));
+        Serial.print(i+1);
+        Serial.print(F(" stopped after "));
+        Serial.print((unsigned long long)(edgeMicros-ch->runStartMicros));
+        Serial.println(F(" us"));
+        }
+      }
+    }
+  }
+
+/*
+ * Milliseconds of runtime the channel has used in this boot.
+ */
+uint64_t channelUsed(int channel, uint64_t now)
+  {
+  const channelState* ch=&channels[channel];
+  if (!senseEnabled)
+    return now; //every run started at power-up
+  if (!limiterRunning(&ch->limiter) && !ch->limiter.timedOut)
+    return 0; //waiting for the load to come on
+  uint64_t start=ch->runStartMicros/1000;
+  return now>start?now-start:0;
+  }
+
+/*
+ * Milliseconds until the next channel times out, or NO_DEADLINE if they
+ * all have.
+ */
+uint64_t nearestRemaining(uint64_t now)
+  {
+  uint64_t nearest=NO_DEADLINE;
+  for (int i=0;i<CHANNEL_COUNT;i++)
+    if (limiterRunning(&channels[i].limiter) && limiterRemaining(&channels[i].limiter,now)<nearest)
+      nearest=limiterRemaining(&channels[i].limiter,now);
+  return nearest;
+  }
+
+/*
+ * The runtime limit of a channel in seconds.
+ */
+unsigned int channelMaxRuntime(int channel)
+  {
+  switch (channel)
+    {
+    case 1:  return settings.maxRuntime2;
+    case 2:  return settings.maxRuntime3;
+    default: return settings.maxRuntime;
+    }
+  }
+
+/*
+ * Milliseconds since boot as a 64 bit number so that it never rolls over.
+ * millis() wraps after about 49 days; the high half is bumped each time it
+ * does.  This must be called at least once every 49 days, which loop() does.
+ */
+uint64_t myMillis()
+  {
+  static uint32_t lastMillis=0;
+  static uint64_t rollovers=0;
+  uint32_t ms=millis();
+  if (ms<lastMillis)
+    rollovers+=0x100000000ULL;
+  lastMillis=ms;
+  return rollovers+ms;
+  }
+
+/*
+ * Add a task to the periodic task table.  It will first run firstDelay
+ * milliseconds from now and every period milliseconds after that.  
+ * Returns the task id, or -1 if the table is full.
+ */
+int addTask(void (*callback)(uint64_t now), unsigned long period, unsigned long firstDelay)
+  {
+  if (taskCount>=MAX_TASKS)
+    {
+    Serial.println(F("************ Task table is full!"));
+    return -1;
+    }
+  periodicTask* task=&tasks[taskCount];
+  task->callback=callback;
+  task->period=period;
+  task->nextRun=period==0?UINT64_MAX:myMillis()+firstDelay;
+  if (taskCount==0 || task->nextRun<nextTaskRun)
+    nextTaskRun=task->nextRun;
+  return taskCount++;
+  }
+
+/*
+ * Make a task run at the given myMillis() time, 0 for the next pass through
+ * loop(), instead of waiting for its period to come around.
+ */
+void triggerTask(int id, uint64_t at)
+  {
+  if (id>=0 && id<taskCount)
+    {
+    tasks[id].nextRun=at;
+    if (at<nextTaskRun)
+      nextTaskRun=at;
+    }
+  }
+
+/*
+ * Change how often a task runs.  A period of zero stops it.
+ */
+void setTaskPeriod(int id, unsigned long period)
+  {
+  if (id<0 || id>=taskCount || tasks[id].period==period)
+    return;
+  tasks[id].period=period;
+  if (period==0)
+    tasks[id].nextRun=UINT64_MAX;
+  else
+    {
+    tasks[id].nextRun=myMillis()+period;
+    if (tasks[id].nextRun<nextTaskRun)
+      nextTaskRun=tasks[id].nextRun;
+    }
+  }
+
+/*
+ * Run any tasks that are due.  If a task falls more than one period behind
+ * it runs once and is rescheduled from now rather than trying to catch up.
+ */
+void runTasks(uint64_t now)
+  {
+  if (now<nextTaskRun)
+    return; //nothing to do yet
+
+  uint64_t earliest=UINT64_MAX;
+  for (int i=0;i<taskCount;i++)
+    {
+    periodicTask* task=&tasks[i];
+    if (now>=task->nextRun)
+      {
+      task->callback(now);
+      task->nextRun+=task->period;
+      if (task->nextRun<=now)
+        task->nextRun=now+task->period;
+      }
+    if (task->nextRun<earliest)
+      earliest=task->nextRun;
+    }
+  nextTaskRun=earliest;
   }
 
 /************************
  * Do the MQTT thing
  ************************/
 
-boolean publish(char* topic, const char* reading, boolean retain)
+boolean publish(const char* topic, const char* reading, boolean retain)
   {
   Serial.print(topic);
-  Serial.print(" ");
+  Serial.print(' ');
   Serial.println(reading);
   return mqttClient.publish(topic,reading,retain); 
   }
@@ -120,111 +640,323 @@ void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length)
   {
   if (settings.debug)
     {
-    Serial.println("====================================> Callback works.");
+    Serial.println(F("====================================> Callback works."));
     }
   payload[length]='\0'; //this should have been done in the caller code, shouldn't have to do it here
-  char charbuf[100];
-  sprintf(charbuf,"%s",payload);
+
+  #ifdef BENCHMARK_MODE
+  if (strcmp(reqTopic,topics.status[0])==0)
+    {
+    benchEcho((char*)payload);
+    return;
+    }
+  #endif
+
+  if (settings.mqttGroupTopic[0]!='\0' && strcmp(reqTopic,settings.mqttGroupTopic)==0
+      && !isGroupCommand((char*)payload))
+    {
+    Serial.print(F("************ Not taking \""));
+    Serial.print((char*)payload);
+    Serial.println(F("\" from the group topic"));
+    return; //no reply, or every unit would send one
+    }
+
+  if (isBatchCommand((char*)payload)) //several settings in one message
+    {
+    char batchResp[60];
+    processBatch((char*)payload,batchResp,sizeof(batchResp));
+    if (!publish(replyTopic(MQTT_TOPIC_BATCH_RESPONSE,strlen(MQTT_TOPIC_BATCH_RESPONSE)),batchResp,false)) //do not retain
+      Serial.println(F("************ Failure when publishing batch response!"));
+    return;
+    }
+
+  //prepare the response topic. The incoming command becomes the topic suffix.
+  //Copy it now because processCommand() works on the payload in place.
+  char topic[TOPIC_BUFFER_SIZE];
+  strcpy(topic,replyTopic((char*)payload,length));
+
   const char* response;
-  char settingsResp[400];
-
-  if (strcmp(charbuf,"settings")==0) //special case, send all settings
-    {
-    strcpy(settingsResp,"\nssid=");
-    strcat(settingsResp,settings.ssid);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"wifipass=");
-    strcat(settingsResp,settings.wifiPassword);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"broker=");
-    strcat(settingsResp,settings.brokerAddress);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"brokerPort=");
-    strcat(settingsResp,String(settings.brokerPort).c_str());
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"userName=");
-    strcat(settingsResp,settings.mqttUsername);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"userPass=");
-    strcat(settingsResp,settings.mqttUserPassword);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"topicRoot=");
-    strcat(settingsResp,settings.mqttTopicRoot);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"runMessage=");
-    strcat(settingsResp,settings.mqttRunMessage);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"lwtMessage=");
-    strcat(settingsResp,settings.mqttLWTMessage);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"timeoutMessage=");
-    strcat(settingsResp,settings.mqttTimeoutMessage);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"maxRuntime=");
-    strcat(settingsResp,String(settings.maxRuntime).c_str());
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"debug=");
-    strcat(settingsResp,settings.debug?"true":"false");
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"MQTT client ID=");
-    strcat(settingsResp,settings.mqttClientId);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"IP Address=");
-    strcat(settingsResp,WiFi.localIP().toString().c_str());
-    response=settingsResp;
-    }
-  else if (processCommand(charbuf))
+
+  if (length==8 && memcmp(payload,"settings",8)==0) //special case, send all settings
+    {
+    publishSettings(topic);
+    return;
+    }
+  else if (length==7 && memcmp(payload,"profile",7)==0) //send the loop profile and start a new one
+    {
+    publishProfile(topic);
+    profileReset();
+    return;
+    }
+  else if (processCommand((char*)payload,length))
     {
     response="OK";
     }
   else
     {
-    char badCmd[18];
-    strcpy(badCmd,"(empty)");
-    response=badCmd;
+    response="(empty)";
     }
 
-  //prepare the response topic
-  char topic[MQTT_MAX_TOPIC_SIZE];
-  strcpy(topic,settings.mqttTopicRoot);
-  strcat(topic,charbuf); //the incoming command becomes the topic suffix
-
   if (!publish(topic,response,false)) //do not retain
-    Serial.println("************ Failure when publishing status response!");
+    Serial.println(F("************ Failure when publishing status response!"));
+  }
+
+/*
+ * Build one topic from the root and a suffix, making sure it fits.
+ */
+void buildTopic(char* topic, const char* suffix)
+  {
+  if (snprintf(topic,TOPIC_BUFFER_SIZE,"%s%s",settings.mqttTopicRoot,suffix)>=TOPIC_BUFFER_SIZE)
+    Serial.println(F("************ Topic too long, truncated!"));
+  }
+
+/*
+ * Rebuild the topic cache.  This has to be called whenever the topic root
+ * changes.
+ */
+void buildTopics()
+  {
+  buildTopic(topics.status[0],MQTT_TOPIC_STATUS);
+  for (int i=1;i<CHANNEL_COUNT;i++)
+    {
+    char suffix[sizeof(MQTT_TOPIC_STATUS)+3];
+    snprintf(suffix,sizeof(suffix),MQTT_TOPIC_STATUS "%d",i+1);
+    buildTopic(topics.status[i],suffix);
+    }
+  buildTopic(topics.rssi,MQTT_TOPIC_RSSI);
+  buildTopic(topics.command,MQTT_TOPIC_COMMAND_REQUEST);
+  buildTopic(topics.telemetry,MQTT_TOPIC_TELEMETRY);
+  buildTopic(topics.event,MQTT_TOPIC_EVENT);
+  buildTopic(topics.cycles,MQTT_TOPIC_CYCLES);
+  buildTopic(topics.reply,"");
+  topics.rootLength=strlen(topics.reply);
   }
 
-boolean sendMessage(char* topic, char* value)
+/*
+ * Return the topic for a reply, which is the root plus the given suffix.
+ * Only the suffix is copied; it is cut short if it doesn't fit.  The result
+ * is good until the next call.
+ */
+const char* replyTopic(const char* suffix, size_t length)
+  {
+  size_t room=sizeof(topics.reply)-topics.rootLength-1;
+  if (length>room)
+    length=room;
+  memcpy(topics.reply+topics.rootLength,suffix,length);
+  topics.reply[topics.rootLength+length]=0;
+  return topics.reply;
+  }
+
+/*
+ * Publish all of the settings.  The message is written straight into the 
+ * MQTT connection as it is generated, so there's no big buffer for it.
+ * It's generated twice, once to find the length for the MQTT header and
+ * once for real.
+ */
+boolean publishSettings(const char* topic)
+  {
+  countingPrint counter;
+  dumpSettings(counter);
+
+  Serial.print(topic);
+  Serial.print(F(" ("));
+  Serial.print(counter.count());
+  Serial.println(F(" bytes)"));
+
+  if (!mqttClient.beginPublish(topic,counter.count(),false)) //do not retain
+    {
+    Serial.println(F("************ Failure when publishing settings!"));
+    return false;
+    }
+  chunkedPrint out(mqttClient);
+  noteStackDepth();
+  dumpSettings(out);
+  out.flush();
+  return mqttClient.endPublish();
+  }
+
+/*
+ * Publish the loop profile, streamed the same way as the settings.
+ */
+boolean publishProfile(const char* topic)
+  {
+  countingPrint counter;
+  profileDump(counter);
+  if (!mqttClient.beginPublish(topic,counter.count(),false)) //do not retain
+    {
+    Serial.println(F("************ Failure when publishing profile!"));
+    return false;
+    }
+  chunkedPrint out(mqttClient);
+  profileDump(out);
+  out.flush();
+  return mqttClient.endPublish();
+  }
+
+boolean sendMessage(const char* topic, const char* value)
   { 
   boolean success=false;
   if (!mqttClient.connected())
     {
-    Serial.println("Not connected to MQTT broker!");
+    Serial.println(F("Not connected to MQTT broker!"));
     }
   else
     {
-    char topicBuf[MQTT_MAX_TOPIC_SIZE+MQTT_MAX_MESSAGE_SIZE];
-    char reading[18];
-//    boolean success=false; //only for the incoming topic and value
-
-    //publish the radio strength reading while we're at it
-    strcpy(topicBuf,settings.mqttTopicRoot);
-    strcat(topicBuf,MQTT_TOPIC_RSSI);
-    sprintf(reading,"%d",WiFi.RSSI()); 
-    success=publish(topicBuf,reading,true); //retain
-    if (!success)
-      Serial.println("************ Failed publishing rssi!");
-    
     //publish the message
-    strcpy(topicBuf,settings.mqttTopicRoot);
-    strcat(topicBuf,topic);
-    success=publish(topicBuf,value,true); //retain
+    success=publish(topic,value,true); //retain
     if (!success)
-      Serial.println("************ Failed publishing "+String(topic)+"! ("+String(success)+")");
+      {
+      Serial.print(F("************ Failed publishing "));
+      Serial.print(topic);
+      Serial.println('!');
+      }
     }
   return success;
   }
 
-void otaSetup()
+/*
+ * Publish the radio strength reading.  Runs periodically from the task table,
+ * and right after connecting to the broker.
+ */
+void rssiTaskCallback(uint64_t now)
+  {
+  if (!halCanPublish())
+    return;
+  char reading[18];
+  noteStackDepth();
+  sprintf(reading,"%d",WiFi.RSSI()); 
+  if (!publish(topics.rssi,reading,true)) //retain
+    Serial.println(F("************ Failed publishing rssi!"));
+  }
+
+/*
+ * Publish the health of the device in one compact message: how long it has
+ * been running and has left, signal strength, heap, stack, loop rate and
+ * reconnects.  Runs every telemetryInterval seconds.
+ */
+void telemetryTaskCallback(uint64_t now)
+  {
+  static uint64_t lastReport=0;
+  uint64_t interval=now-lastReport;
+  unsigned long loopRate=interval>0?(unsigned long)(loopCount*1000ULL/interval):0;
+  unsigned int idlePercent=interval>0?(unsigned int)(idleMicros/10/interval):0;
+  lastReport=now;
+  loopCount=0;
+  idleMicros=0;
+
+  //There's no way to measure the current, so estimate what the time spent
+  //idle saved using typical figures for the module.
+  unsigned int sleepCurrent=settings.powerSave==POWER_SAVE_LIGHT?POWER_LIGHT_SLEEP_MA:POWER_MODEM_SLEEP_MA;
+  unsigned int savedCurrent=settings.powerSave==POWER_SAVE_OFF?0:idlePercent*(POWER_ACTIVE_MA-sleepCurrent)/100;
+  if (!mqttClient.connected())
+    return;
+
+  char payload[TELEMETRY_PAYLOAD_SIZE];
+  int len=0;
+  if (clockValid())
+    len=snprintf(payload,sizeof(payload),"{\"ts\":%llu,",(unsigned long long)clockNowMs());
+  else
+    payload[len++]='{';
+  snprintf(payload+len,sizeof(payload)-len,
+           "\"elapsed\":%llu,\"remaining\":%llu,\"rssi\":%d,\"heap\":%u,"
+           "\"frag\":%u,\"block\":%u,\"stack\":%u,\"lps\":%lu,\"reconnects\":%u,"
+           "\"resets\":%u,\"resetReason\":%u,\"duty\":%u,\"idle\":%u,\"savedmA\":%u}",
+           (unsigned long long)now,
+           (unsigned long long)limiterRemaining(&channels[0].limiter,now),
+           WiFi.RSSI(),
+           ESP.getFreeHeap(),
+           ESP.getHeapFragmentation(),
+           ESP.getMaxFreeBlockSize(),
+           (unsigned int)maxStackDepth,
+           loopRate,
+           mqttConnectCount>0?mqttConnectCount-1:0,
+           runtimeResets(),
+           (unsigned int)runtimeResetReason(),
+           (unsigned int)dutyUsed(),
+           idlePercent,
+           savedCurrent);
+  if (!publish(topics.telemetry,payload,false)) //not retained
+    Serial.println(F("************ Failed publishing telemetry!"));
+  }
+
+/*
+ * Show the time remaining before each timeout on the serial port.
+ */
+void countdownTaskCallback(uint64_t now)
+  {
+  if (!settings.debug || !settingsAreValid)
+    return;
+  for (int i=0;i<CHANNEL_COUNT;i++)
+    {
+    if (!limiterRunning(&channels[i].limiter))
+      continue;
+    if (CHANNEL_COUNT>1)
+      {
+      Serial.print(F("Channel "));
+      Serial.print(i+1);
+      Serial.print(F(": "));
+      }
+    Serial.print(limiterRemaining(&channels[i].limiter,now));
+    Serial.println(F(" ms remaining"));
+    }
+  }
+
+/*
+ * Keep the RTC memory up to date with the runtime used, so a reset
+ * doesn't start the run over, and move the duty cycle window along.
+ */
+void runtimeTaskCallback(uint64_t now)
+  {
+  for (int i=0;i<CHANNEL_COUNT;i++)
+    runtimeSave(i,channelUsed(i,now),channels[i].limiter.timedOut);
+  dutyUpdate(now,limiterRunning(&channels[0].limiter));
+  cycleUpdate(now,!channels[0].limiter.timedOut);
+  }
+
+/*
+ * Flash each warning LED once its timeout has been reported.
+ */
+void flashTaskCallback(uint64_t now)
+  {
+  for (int i=0;i<CHANNEL_COUNT;i++)
+    {
+    channelState* ch=&channels[i];
+    if (ch->limiter.timedOut && ch->limiter.timeoutMessageSent)
+      {
+      digitalWrite(ch->ledPort,ch->ledState);
+      ch->ledState=!ch->ledState;
+      }
+    }
+  }
+
+/*
+ * True if the string is an MD5 hash as ArduinoOTA wants it, 32 lower case
+ * hex digits.
+ */
+boolean isMd5Hex(const char* s)
+  {
+  return strlen(s)==32 && strspn(s,"0123456789abcdef")==32;
+  }
+
+/*
+ * The password that guards OTA and the settings form: otaPassword, or the
+ * WiFi password if that is empty or is an MD5 hash (which only OTA can
+ * check).  NULL if it is shorter than OTA_PASSWORD_MIN_LENGTH, and then
+ * neither is open to anyone.
+ */
+const char* adminPassword()
+  {
+  const char* password=settings.otaPassword[0]!='\0' && !isMd5Hex(settings.otaPassword)?settings.otaPassword:settings.wifiPassword;
+  if (strlen(password)<OTA_PASSWORD_MIN_LENGTH)
+    return NULL;
+  return password;
+  }
+
+/*
+ * Start listening for OTA updates.  Returns false if there is no usable
+ * password, in which case OTA stays off.
+ */
+boolean otaSetup()
   {
   // Port defaults to 3232
   // ArduinoOTA.setPort(3232);
@@ -232,515 +964,930 @@ void otaSetup()
   // Hostname defaults to esp3232-[MAC]
   // ArduinoOTA.setHostname("myesp32");
 
-  // No authentication by default
-  // ArduinoOTA.setPassword("admin");
-
-  // Password can be set with it's md5 value as well
-  // MD5(admin) = 21232f297a57a5a743894a0e4a801fc3
-  // ArduinoOTA.setPasswordHash("21232f297a57a5a743894a0e4a801fc3");
+  // Nobody on the LAN should be able to flash it, so OTA takes the same
+  // admin password as the settings form, and is off without one.  Only
+  // otaPassword can be given as a hash, which keeps the password itself out
+  // of the settings.
+  if (isMd5Hex(settings.otaPassword))
+    ArduinoOTA.setPasswordHash(settings.otaPassword);
+  else
+    {
+    const char* password=adminPassword();
+    if (password==NULL)
+      {
+      Serial.print(F("************ No OTA password of at least "));
+      Serial.print(OTA_PASSWORD_MIN_LENGTH);
+      Serial.println(F(" characters, OTA updates are off."));
+      return false;
+      }
+    ArduinoOTA.setPassword(password);
+    }
 
   ArduinoOTA.onStart([]() 
     {
-    String type;
-    if (ArduinoOTA.getCommand() == U_FLASH)
-      type = "sketch";
-    else // U_SPIFFS
-      type = "filesystem";
-
+    //Nothing is watching the runtime while the flash is being written
+    for (int i=0;i<CHANNEL_COUNT;i++)
+      halSetRelay(i,false);
     // NOTE: if updating SPIFFS this would be the place to unmount SPIFFS using SPIFFS.end()
-    Serial.println("Start updating " + type);
+    Serial.print(F("Start updating "));
+    Serial.println(ArduinoOTA.getCommand()==U_FLASH?F("sketch"):F("filesystem")); //else U_SPIFFS
+    });
+
+    ArduinoOTA.onEnd([]() {
+      if (ArduinoOTA.getCommand()==U_FLASH && settings.otaValidate>0)
+        bootCheckFlashed(); //the new image has to prove itself
+      Serial.println(F("\nEnd"));
+    });
+
+    ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
+      static unsigned long lastPrint=0;
+      if (millis()-lastPrint<OTA_PROGRESS_INTERVAL_MS && progress<total)
+        return; //printing every chunk slows the upload down
+      lastPrint=millis();
+      Serial.printf_P(PSTR("Progress: %u%%\r"), (unsigned int)(progress*100ULL/total));
     });
 
-    ArduinoOTA.onEnd([]() {
-      Serial.println("\nEnd");
-    });
+    ArduinoOTA.onError([](ota_error_t error) {
+      //Still running the old image, put the relays back
+      for (int i=0;i<CHANNEL_COUNT;i++)
+        if (!channels[i].limiter.timedOut && !bootCheckSafeMode())
+          halSetRelay(i,true);
+      Serial.printf_P(PSTR("Error[%u]: "), error);
+      if (error == OTA_AUTH_ERROR) Serial.println(F("Auth Failed"));
+      else if (error == OTA_BEGIN_ERROR) Serial.println(F("Begin Failed"));
+      else if (error == OTA_CONNECT_ERROR) Serial.println(F("Connect Failed"));
+      else if (error == OTA_RECEIVE_ERROR) Serial.println(F("Receive Failed"));
+      else if (error == OTA_END_ERROR) Serial.println(F("End Failed"));
+    });
+
+  ArduinoOTA.begin();
+  return true;
+  }
+
+void setup() 
+  {
+  //init record of stack
+  char stack;
+  stack_start = &stack;  
+  
+  pinMode(LED_BUILTIN,OUTPUT);// The blue light on the board shows WiFi activity
+  digitalWrite(LED_BUILTIN,LED_OFF);
+  boolean resumed=runtimeBegin(); //was a run already under way before a reset?
+  static const uint8_t relayPorts[CHANNEL_MAX]=CHANNEL_RELAY_PORTS;
+  static const uint8_t ledPorts[CHANNEL_MAX]=CHANNEL_LED_PORTS;
+  for (int i=0;i<CHANNEL_COUNT;i++)
+    {
+    channels[i].limiter.channel=i;
+    channels[i].relayPort=relayPorts[i];
+    channels[i].ledPort=ledPorts[i];
+    channels[i].ledState=LED_ON;
+    pinMode(relayPorts[i],OUTPUT); // The port for the SSRs
+    //turn on the device unless it already timed out before a reset
+    digitalWrite(relayPorts[i],runtimeExhausted(i)?RELAY_OFF:RELAY_ON);
+    pinMode(ledPorts[i],OUTPUT); // The port for the warning LED
+    digitalWrite(ledPorts[i],LED_OFF); //turn off the LED until we time out
+    }
+
+  //Both GPIO 0 and GPIO2 must be high before the ESP-01s will boot from flash.
+  //GPIO0 is high by virtue of the warning LED.  I had to use GPIO3 for the output
+  //control but it is the serial I/O RX pin. This next line frees up the RX pin 
+  //so I can use it for this purpose. Unfortunately it also disallows receiving
+  //commands from the serial port, so all commands must be passed in via MQTT.
+  //The PRECONFIGURE keyword at the top of this file must be defined in order
+  //to do the initial configuration via the serial port. After the initial settings
+  //are entered and the ESP can contact the MQTT server, remove the keyword,
+  //reload the firmware to the ESP, and configure via MQTT exclusively.
+  #ifdef PRECONFIGURE
+    Serial.setRxBufferSize(CONSOLE_RX_BUFFER_SIZE); //holds a paste while loop() works through it
+    Serial.begin(115200);
+  #else
+    Serial.begin(115200,SERIAL_8N1,SERIAL_TX_ONLY); 
+  #endif
+
+  Serial.setTimeout(10000);
+  Serial.println();
+  
+  while (!Serial); // wait here for serial port to connect.
+  Serial.println(F("Running."));
+
+  //reset the wifi
+//  WiFi.disconnect(true); 
+//  WiFi.softAPdisconnect(true);
+//  ESP.eraseConfig();
+
+  WiFi.persistent(false); //we keep our own copy of the WiFi settings, don't rewrite the SDK's on every boot
+  qos1Begin(wifiClient); //QoS 1 status messages share the broker connection
+
+  useSettingsLog=storeBegin(); //find the settings in flash
+
+  if (settings.debug)
+    Serial.println(F("Loading settings"));
+  loadSettings(); //set the values from eeprom
+
+  Serial.print(F("Performing settings sanity check..."));
+  if ((settings.validConfig!=0 && 
+      settings.validConfig!=VALID_SETTINGS_FLAG) || //should always be one or the other
+      settings.brokerPort<0 ||
+      settings.brokerPort>65535)
+    {
+    Serial.println(F("\nSettings in eeprom failed sanity check, initializing."));
+    initializeSettings(); //must be a new board or flash was erased
+    }
+  else
+    Serial.println(F("passed."));
+
+  if (bootCheckBegin())
+    Serial.println(F("New firmware, waiting for it to reach the broker."));
+
+  jitterBegin(); //needs the client ID
+
+  eventBegin(); //anything that didn't get out before a reset is still queued
+  eventLog(EVENT_START);
+
+  uint64_t now=myMillis();
+  if (resumed)
+    {
+    Serial.print(F("Resuming the run after a reset, reason "));
+    Serial.print(runtimeResetReason());
+    Serial.print(F(", ms already used:"));
+    for (int i=0;i<CHANNEL_COUNT;i++)
+      {
+      Serial.print(' ');
+      Serial.print((unsigned long)runtimeUsed(i));
+      }
+    Serial.println();
+    }
+  dutyBegin(settings.dutyWindow,settings.dutyAllowed);
+  cycleBegin(settings.shortCycleOff,settings.shortCycleCount);
+  if (settings.runSense!=RUN_SENSE_OFF)
+    senseBegin(now); //each run is timed from the sense input instead
+  else
+    {
+    //the run message goes out as soon as the broker connection comes up, and the
+    //relay will be turned off by the timer even if loop() is busy
+    for (int i=0;i<CHANNEL_COUNT;i++)
+      {
+      uint64_t budget=(uint64_t)channelMaxRuntime(i)*1000; //milliseconds until timeout occurs
+      budget=budget>runtimeUsed(i)?budget-runtimeUsed(i):0;
+      if (i==0 && dutyRemaining()!=DUTY_UNLIMITED && now+dutyRemaining()*1000ULL<budget)
+        {
+        Serial.print(F("Duty cycle limit applies, "));
+        Serial.print(dutyUsed());
+        Serial.println(F(" seconds used in the window."));
+        budget=now+dutyRemaining()*1000ULL;
+        }
+      limiterStart(&channels[i].limiter,budget);
+      armCutoffTimer(i,limiterRemaining(&channels[i].limiter,now));
+      }
+    }
+
+  addTask(countdownTaskCallback,COUNTDOWN_INTERVAL_MS,0);
+  addTask(runtimeTaskCallback,RUNTIME_SAVE_INTERVAL_MS,RUNTIME_SAVE_INTERVAL_MS);
+  rssiTask=addTask(rssiTaskCallback,RSSI_PUBLISH_INTERVAL_MS,RSSI_PUBLISH_INTERVAL_MS);
+  telemetryTask=addTask(telemetryTaskCallback,settings.telemetryInterval*1000UL,settings.telemetryInterval*1000UL);
+  if (FLASH_LED)
+    addTask(flashTaskCallback,LED_FLASH_INTERVAL_MS,LED_FLASH_INTERVAL_MS);
+
+  #ifdef BENCHMARK_MODE
+  static char benchTopic[TOPIC_BUFFER_SIZE];
+  buildTopic(benchTopic,MQTT_TOPIC_BENCH);
+  benchBegin(topics.status[0],benchTopic);
+  #endif
+  connectionService(now); //start connecting to the wifi
+  }
+
+void loop()
+  {
+  uint32_t loopStart=ESP.getCycleCount();
+  uint32_t stageStart=loopStart;
+  uint64_t now=myMillis(); //read the clock once, everything below works from this
+  loopCount++;
+
+  connectionService(now); //keep the WiFi and MQTT connections up without waiting on them
+  switch (bootCheckService(now,mqttClient.connected(),settings.otaValidate*1000UL))
+    {
+    case BOOT_CHECK_RESTART:
+      Serial.println(F("Restarting to check the new firmware."));
+      delay(100); //let it get out
+      ESP.restart();
+      break;
+    case BOOT_CHECK_SAFE_MODE:
+      Serial.println(F("************ New firmware never reached the broker, relays off until it does or it is replaced"));
+      for (int i=0;i<CHANNEL_COUNT;i++)
+        halSetRelay(i,false);
+      break;
+    default:
+      break;
+    }
+  profileRecord(PROFILE_CONNECTION,stageStart);
+
+  stageStart=ESP.getCycleCount();
+  qos1Service(); //before mqttClient.loop() so it sees the PUBACKs
+  mqttClient.loop(); //This has to happen every so often or we get disconnected for some reason
+  profileRecord(PROFILE_MQTT,stageStart);
+
+  stageStart=ESP.getCycleCount();
+  checkForCommand(); // Check for input in case something needs to be changed to work
+  profileRecord(PROFILE_COMMAND,stageStart);
+
+  if (otaStarted)
+    {
+    stageStart=ESP.getCycleCount();
+    if (otaEnabled)
+      ArduinoOTA.handle(); //Check for new version
+    profileRecord(PROFILE_OTA,stageStart);
+
+    stageStart=ESP.getCycleCount();
+    webService(); //anybody looking at the web page?
+    profileRecord(PROFILE_WEB,stageStart);
+    }
+
+  stageStart=ESP.getCycleCount();
+  senseService(now); //start and stop sensed runs
+  for (int i=0;i<CHANNEL_COUNT;i++)
+    {
+    channelState* ch=&channels[i];
+    limiterMessages messages={topics.status[i],settings.mqttRunMessage,settings.mqttTimeoutMessage,settingsAreValid,renderMessage,ch};
+    #ifdef BENCHMARK_MODE
+    if (i==0)
+      benchMessages(&messages);
+    #endif
+    if (limiterService(&ch->limiter,now,(cutoffFired>>i)&1,&messages) //run message, cutoff and timeout message
+        && i==0) //the run records are for the first channel
+      {
+      eventLog(EVENT_TIMEOUT);
+      dutyCheckpoint(); //the run is over, don't lose it if the power goes
+      cycleRunEnded(now);
+      }
+    }
+  #ifdef BENCHMARK_MODE
+  benchService(&channels[0].limiter,now,cutoffMicros);
+  #endif
+  profileRecord(PROFILE_CUTOFF,stageStart);
+
+  stageStart=ESP.getCycleCount();
+  runTasks(now); //countdown, LED flashing, RSSI
+  profileRecord(PROFILE_TASKS,stageStart);
+
+  if (clockService()) //SNTP just set the clock
+    eventStamp();
+  eventDrain(topics.event); //one queued event per pass
+  cyclePublishAlert(topics.cycles);
+
+  powerSaveIdle(now);
+
+  if (settingsDirty && now>=settingsCommitTime)
+    commitSettings();
+  profileRecord(PROFILE_LOOP,loopStart);
+  }
+
+
+/*
+ * If power saving is on, wait a little so the SDK can sleep.  The wait ends
+ * early for the next task, and close to the deadline the WiFi is kept fully
+ * awake and the cutoff timer is reloaded, since light sleep stops it.  Incoming MQTT
+ * commands are picked up on the next pass, at most POWER_SAVE_IDLE_MS later
+ * plus the access point's beacon interval.
+ */
+void powerSaveIdle(uint64_t now)
+  {
+  static WiFiSleepType_t sleepMode=WiFi.getSleepMode(); //what the SDK started with
+  if (settings.powerSave==POWER_SAVE_OFF)
+    {
+    if (WiFi.getSleepMode()!=sleepMode)
+      WiFi.setSleepMode(sleepMode); //back to the way it was
+    return;
+    }
+
+  uint64_t remaining=nearestRemaining(now);
+  boolean nearDeadline=remaining<=POWER_SAVE_GUARD_MS;
+  WiFiSleepType_t wanted=nearDeadline?WIFI_NONE_SLEEP
+                        :settings.powerSave==POWER_SAVE_LIGHT?WIFI_LIGHT_SLEEP:WIFI_MODEM_SLEEP;
+  if (WiFi.getSleepMode()!=wanted)
+    {
+    WiFi.setSleepMode(wanted);
+    //Timer1 doesn't count while the CPU is in light sleep, so start it over
+    //with the true time left now that we're staying awake.
+    if (nearDeadline)
+      for (int i=0;i<CHANNEL_COUNT;i++)
+        if (limiterRunning(&channels[i].limiter))
+          armCutoffTimer(i,limiterRemaining(&channels[i].limiter,now));
+    }
+  if (nearDeadline)
+    return;
+
+  uint64_t wait=POWER_SAVE_IDLE_MS;
+  if (nextTaskRun>now && nextTaskRun-now<wait)
+    wait=nextTaskRun-now;
+  else if (nextTaskRun<=now)
+    return; //something is due
+  if (remaining!=NO_DEADLINE && remaining-POWER_SAVE_GUARD_MS<wait)
+    wait=remaining-POWER_SAVE_GUARD_MS;
+
+  uint32_t start=micros();
+  delay(wait);
+  idleMicros+=micros()-start;
+  }
+
+static const char resetPowerOn[] PROGMEM = "power on";
+static const char resetWatchdog[] PROGMEM = "watchdog";
+static const char resetException[] PROGMEM = "exception";
+static const char resetSoftWatchdog[] PROGMEM = "soft watchdog";
+static const char resetRestart[] PROGMEM = "restart";
+static const char resetDeepSleep[] PROGMEM = "deep sleep";
+static const char resetExternal[] PROGMEM = "reset pin";
+static const char* const resetNames[] PROGMEM =
+  {
+  resetPowerOn,        //REASON_DEFAULT_RST
+  resetWatchdog,       //REASON_WDT_RST
+  resetException,      //REASON_EXCEPTION_RST
+  resetSoftWatchdog,   //REASON_SOFT_WDT_RST
+  resetRestart,        //REASON_SOFT_RESTART
+  resetDeepSleep,      //REASON_DEEP_SLEEP_AWAKE
+  resetExternal        //REASON_EXT_SYS_RST
+  };
+
+/*
+ * The fields that can be used in the status messages:
+ *   {id}        MQTT client ID
+ *   {channel}   channel number, starting at 1
+ *   {runtime}   seconds run so far, including before any warm reset
+ *   {remaining} seconds until the timeout
+ *   {uptime}    seconds since this boot
+ *   {rssi}      WiFi signal strength
+ *   {ip}        IP address
+ *   {reset}     why the last reset happened
+ *   {cycles}    power cycles counted
+ *   {ts}        milliseconds since the Unix epoch, 0 if SNTP hasn't set the clock
+ * The context is the channel, NULL for the first one.
+ */
+void messageResolver(Print& out, const char* key, const void* context)
+  {
+  uint64_t now=myMillis();
+  const channelState* ch=context!=NULL?(const channelState*)context:&channels[0];
+  if (strcmp_P(key,PSTR("id"))==0)
+    out.print(settings.mqttClientId);
+  else if (strcmp_P(key,PSTR("channel"))==0)
+    out.print(ch->limiter.channel+1);
+  else if (strcmp_P(key,PSTR("runtime"))==0)
+    out.print((unsigned long)((runtimeUsed(ch->limiter.channel)+channelUsed(ch->limiter.channel,now))/1000));
+  else if (strcmp_P(key,PSTR("remaining"))==0)
+    out.print((unsigned long)(limiterRemaining(&ch->limiter,now)/1000));
+  else if (strcmp_P(key,PSTR("uptime"))==0)
+    out.print((unsigned long)(now/1000));
+  else if (strcmp_P(key,PSTR("rssi"))==0)
+    out.print(WiFi.RSSI());
+  else if (strcmp_P(key,PSTR("ip"))==0)
+    out.print(WiFi.localIP());
+  else if (strcmp_P(key,PSTR("reset"))==0)
+    {
+    uint32_t reason=runtimeResetReason();
+    if (reason<sizeof(resetNames)/sizeof(resetNames[0]))
+      out.print(FPSTR((const char*)pgm_read_ptr(&resetNames[reason])));
+    else
+      out.print(reason);
+    }
+  else if (strcmp_P(key,PSTR("cycles"))==0)
+    out.print(cycleCount());
+  else if (strcmp_P(key,PSTR("ts"))==0)
+    out.print((unsigned long long)clockNowMs());
+  }
+
+/*
+ * Fill in a status message for limiter.cpp.
+ */
+size_t renderMessage(char* buf, size_t size, const char* message, const void* context)
+  {
+  return renderTemplate(buf,size,message,messageResolver,context);
+  }
+
+/*
+ * Hardware services for limiter.cpp, see hal.h.
+ */
+void halSetRelay(uint8_t channel, bool on)
+  {
+  digitalWrite(channels[channel].relayPort,on?RELAY_ON:RELAY_OFF);
+  }
+
+void halSetLed(uint8_t channel, bool on)
+  {
+  digitalWrite(channels[channel].ledPort,on?LED_ON:LED_OFF);
+  }
+
+bool halConnected()
+  {
+  return mqttClient.connected();
+  }
 
-    ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
-      Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
-    });
+bool halCanPublish()
+  {
+  return mqttClient.connected() && myMillis()>=publishHoldUntil;
+  }
 
-    ArduinoOTA.onError([](ota_error_t error) {
-      Serial.printf("Error[%u]: ", error);
-      if (error == OTA_AUTH_ERROR) Serial.println("Auth Failed");
-      else if (error == OTA_BEGIN_ERROR) Serial.println("Begin Failed");
-      else if (error == OTA_CONNECT_ERROR) Serial.println("Connect Failed");
-      else if (error == OTA_RECEIVE_ERROR) Serial.println("Receive Failed");
-      else if (error == OTA_END_ERROR) Serial.println("End Failed");
-    });
+bool halPublish(const char* topic, const char* payload, bool retain)
+  {
+  if (retain)
+    return sendMessage(topic,payload);
+  return publish(topic,payload,false);
+  }
 
-  ArduinoOTA.begin();
+uint16_t halPublishReliable(const char* topic, const char* payload)
+  {
+  return qos1Publish(topic,payload,true);
   }
 
-void setup() 
+bool halDelivered(uint16_t id)
   {
-  //init record of stack
-  char stack;
-  stack_start = &stack;  
-  
-  pinMode(LED_BUILTIN,OUTPUT);// The blue light on the board shows WiFi activity
-  digitalWrite(LED_BUILTIN,LED_OFF);
-  pinMode(RELAY_PORT,OUTPUT); // The port for the SSRs
-  digitalWrite(RELAY_PORT,RELAY_ON); //turn on the device
-  pinMode(LED_PORT,OUTPUT); // The port for the warning LED
-  digitalWrite(LED_PORT,LED_OFF); //turn off the LED until we time out
+  return qos1Delivered(id);
+  }
 
-  //Both GPIO 0 and GPIO2 must be high before the ESP-01s will boot from flash.
-  //GPIO0 is high by virtue of the warning LED.  I had to use GPIO3 for the output
-  //control but it is the serial I/O RX pin. This next line frees up the RX pin 
-  //so I can use it for this purpose. Unfortunately it also disallows receiving
-  //commands from the serial port, so all commands must be passed in via MQTT.
-  //The PRECONFIGURE keyword at the top of this file must be defined in order
-  //to do the initial configuration via the serial port. After the initial settings
-  //are entered and the ESP can contact the MQTT server, remove the keyword,
-  //reload the firmware to the ESP, and configure via MQTT exclusively.
-  #ifdef PRECONFIGURE
-    Serial.begin(115200);
-  #else
-    Serial.begin(115200,SERIAL_8N1,SERIAL_TX_ONLY); 
-  #endif
 
-  Serial.setTimeout(10000);
-  Serial.println();
-  
-  while (!Serial); // wait here for serial port to connect.
-  Serial.println(F("Running."));
+/*
+ * Seed jitter() from the client ID and chip ID, so that every unit gets a
+ * different sequence.  Call once the settings are loaded.
+ */
+void jitterBegin()
+  {
+  jitterState=crc32(settings.mqttClientId,strlen(settings.mqttClientId))^ESP.getChipId();
+  if (jitterState==0)
+    jitterState=1; //xorshift sticks at zero
+  }
 
-  //reset the wifi
-//  WiFi.disconnect(true); 
-//  WiFi.softAPdisconnect(true);
-//  ESP.eraseConfig();
+/*
+ * A pseudo-random number of milliseconds from 0 to range-1.  After a power
+ * outage every unit boots at once, and this spreads out their connection
+ * attempts and first reports so the broker isn't hit by all of them together.
+ */
+unsigned long jitter(unsigned long range)
+  {
+  #ifdef BENCHMARK_MODE
+  return 0; //it would only add noise to the latency numbers
+  #endif
+  jitterState^=jitterState<<13;
+  jitterState^=jitterState>>17;
+  jitterState^=jitterState<<5;
+  return range==0?0:jitterState%range;
+  }
 
-  EEPROM.begin(sizeof(settings)); //fire up the eeprom section of flash
-  commandString.reserve(200); // reserve 200 bytes of serial buffer space for incoming command string
+/*
+ * Compute the next retry delay. Starts at CONNECT_BACKOFF_MIN_MS and doubles
+ * on each failure up to CONNECT_BACKOFF_MAX_MS, plus up to a quarter more
+ * of jitter so that units that failed together don't retry together.
+ */
+unsigned long nextBackoff(unsigned long backoff)
+  {
+  unsigned long next;
+  if (backoff<CONNECT_BACKOFF_MIN_MS)
+    next=CONNECT_BACKOFF_MIN_MS;
+  else if (backoff>=CONNECT_BACKOFF_MAX_MS/2)
+    next=CONNECT_BACKOFF_MAX_MS;
+  else
+    next=backoff*2;
+  return next+jitter(next/4);
+  }
 
+/*
+ * Remember the AP and address of the connection we just made so that the 
+ * next boot can skip the scan and DHCP.  Flash is only written if 
+ * something changed.
+ */
+void updateFastConnectCache()
+  {
+  fastConnectCache* cache=&settings.fastCache;
+  uint8_t* bssid=WiFi.BSSID();
+  if (cache->valid==VALID_FAST_CONNECT_FLAG
+      && memcmp(cache->bssid,bssid,sizeof(cache->bssid))==0
+      && cache->channel==WiFi.channel()
+      && cache->ip==(uint32_t)WiFi.localIP()
+      && cache->gateway==(uint32_t)WiFi.gatewayIP()
+      && cache->subnet==(uint32_t)WiFi.subnetMask()
+      && cache->dns==(uint32_t)WiFi.dnsIP())
+    return; //nothing new
+
+  memcpy(cache->bssid,bssid,sizeof(cache->bssid));
+  cache->channel=WiFi.channel();
+  cache->ip=WiFi.localIP();
+  cache->gateway=WiFi.gatewayIP();
+  cache->subnet=WiFi.subnetMask();
+  cache->dns=WiFi.dnsIP();
+  cache->valid=VALID_FAST_CONNECT_FLAG;
   if (settings.debug)
-    Serial.println(F("Loading settings"));
-  loadSettings(); //set the values from eeprom
+    Serial.println(F("Saving fast connect information."));
+  saveSettings();
+  }
 
-  Serial.print("Performing settings sanity check...");
-  if ((settings.validConfig!=0 && 
-      settings.validConfig!=VALID_SETTINGS_FLAG) || //should always be one or the other
-      settings.brokerPort<0 ||
-      settings.brokerPort>65535)
+/*
+ * Start associating with the AP.  If fast connect is on and we have a 
+ * cached connection, go straight to the known AP on its channel with the 
+ * address we had last time.  Otherwise do a normal scan and DHCP.
+ */
+void startWiFi()
+  {
+  WiFi.mode(WIFI_STA); //station mode, we are only a client in the wifi world
+  fastConnectAttempt=settings.fastConnect 
+                  && settings.fastCache.valid==VALID_FAST_CONNECT_FLAG;
+  if (fastConnectAttempt)
     {
-    Serial.println("\nSettings in eeprom failed sanity check, initializing.");
-    initializeSettings(); //must be a new board or flash was erased
+    fastConnectCache* cache=&settings.fastCache;
+    if (settings.debug)
+      Serial.println(F("Using fast connect."));
+    WiFi.config(IPAddress(cache->ip),
+                IPAddress(cache->gateway),
+                IPAddress(cache->subnet),
+                IPAddress(cache->dns));
+    WiFi.begin(settings.ssid, settings.wifiPassword, cache->channel, cache->bssid);
     }
   else
-    Serial.println("passed.");
-
-  timeoutCount=settings.maxRuntime*1000; //milliseconds until timeout occurs
-
-  if (settings.validConfig==VALID_SETTINGS_FLAG)
-    connectToWiFi(); //connect to the wifi
-  
-  if (WiFi.status() == WL_CONNECTED)
     {
-    sendMessage(MQTT_TOPIC_STATUS, settings.mqttRunMessage); //running!
-    otaSetup(); //initialize the OTA stuff
+    WiFi.config(IPAddress(0u),IPAddress(0u),IPAddress(0u)); //use DHCP
+    WiFi.begin(settings.ssid, settings.wifiPassword);
     }
   }
 
-void loop()
+/*
+ * Called when the association completes, either from our own WiFi.begin()
+ * or from the SDK reconnecting on its own.
+ */
+void wifiConnected(uint64_t now)
   {
-  static boolean wrapped=false; //for countdown timer
-  static unsigned long lastTime=0;
-  mqttClient.loop(); //This has to happen every so often or we get disconnected for some reason
-  checkForCommand(); // Check for input in case something needs to be changed to work
-  ArduinoOTA.handle(); //Check for new version
-
-  if (settings.debug 
-      && millis()%5000==0 
-      && !wrapped 
-      && settingsAreValid
-      && !timeoutMessageSent) 
-    {
-    unsigned long remainingTime=timeoutCount-millis();
-    if (remainingTime>4294900000)
-      wrapped=true; //that's about as close as we can get
-    if (remainingTime != lastTime && !wrapped)
-      {
-      Serial.print(remainingTime);
-      Serial.println(" ms remaining");
-      lastTime=remainingTime;
-      }
-    }
-
-  if (millis()>=timeoutCount && !timeoutMessageSent)
+  digitalWrite(LED_BUILTIN,LED_ON); //show we're connected
+  if (settings.fastConnect)
+    updateFastConnectCache();
+  if (settings.debug)
     {
-    digitalWrite(RELAY_PORT,RELAY_OFF); //turn off the device
-    digitalWrite(LED_PORT,LED_ON); //turn on the failure LED
-    if (settingsAreValid)
-      {
-      connectToWiFi(); //make sure we're connected to the broker
-      timeoutMessageSent=sendMessage(MQTT_TOPIC_STATUS, settings.mqttTimeoutMessage);
-      }
+    Serial.println(F("Connected to network."));
+    Serial.println();
     }
+  //show the IP address
+  Serial.println(WiFi.localIP());
 
-  if (FLASH_LED)
+  if (!otaStarted)
     {
-    static unsigned long nextFlashTime=millis()+250;
-    if (millis()>=timeoutCount && millis()>nextFlashTime && timeoutMessageSent) //flash the led
-      {
-      static boolean warning_led_state=LED_ON;
-      digitalWrite(LED_PORT,warning_led_state);
-      warning_led_state=!warning_led_state;
-      nextFlashTime=millis()+250; //half second flash rate
-      }
+    otaEnabled=otaSetup(); //initialize the OTA stuff
+    otaStarted=true;
+    clockBegin(settings.ntpServer); //sets itself in the background
+    webBegin(); //status and settings pages
     }
-  }
 
+  wifiBackoff=CONNECT_BACKOFF_MIN_MS;
+  mqttBackoff=jitter(CONNECT_JITTER_MS); //soon, but not at the same moment as the rest of the fleet
+  connectionTimer=now;
+  connectionState=CONN_MQTT_DOWN;
+  }
 
 /*
- * If not connected to wifi, connect.
+ * Keep the WiFi and MQTT connections up.  This is called on every pass through
+ * loop() and never waits for the network; each call does at most one step
+ * of the connection process.  Failed attempts are retried with an exponential
+ * backoff so that a missing AP or broker doesn't eat up the loop.
  */
-boolean connectToWiFi()
+void connectionService(uint64_t now)
   {
-  yield();
-  static boolean retval=true; //assume connection to wifi is ok
-  if (settingsAreValid && WiFi.status() != WL_CONNECTED)
+  if (!settingsAreValid)
+    return;
+
+  boolean associated=WiFi.status() == WL_CONNECTED;
+
+  //Drop back to the start if the WiFi goes away
+  if (!associated 
+      && connectionState!=CONN_WIFI_DOWN 
+      && connectionState!=CONN_WIFI_CONNECTING)
     {
-    if (settings.debug)
-      {
-      Serial.print(F("Attempting to connect to WPA SSID \""));
-      Serial.print(settings.ssid);
-      Serial.print("\" with passphrase \"");
-      Serial.print(settings.wifiPassword);
-      Serial.println("\"");
-      }
+    Serial.println(F("WiFi connection lost."));
+    digitalWrite(LED_BUILTIN,LED_OFF); //stay off until we connect
+    mqttClient.disconnect();
+    wifiBackoff=0; //try again right away
+    connectionTimer=now;
+    connectionState=CONN_WIFI_DOWN;
+    }
 
-    WiFi.mode(WIFI_STA); //station mode, we are only a client in the wifi world
-    WiFi.begin(settings.ssid, settings.wifiPassword);
+  switch (connectionState)
+    {
+    case CONN_WIFI_DOWN:
+      if (associated) //the SDK reconnected by itself
+        {
+        wifiConnected(now);
+        }
+      else if (now-connectionTimer>=wifiBackoff)
+        {
+        if (settings.debug)
+          {
+          Serial.print(F("Attempting to connect to WPA SSID \""));
+          Serial.print(settings.ssid);
+          Serial.print(F("\" with passphrase \""));
+          Serial.print(settings.wifiPassword);
+          Serial.println('"');
+          }
+        startWiFi();
+        connectionTimer=now;
+        connectionState=CONN_WIFI_CONNECTING;
+        }
+      break;
 
-    //try for a few seconds to connect to wifi
-    for (int i=0;i<WIFI_CONNECTION_ATTEMPTS;i++)  
-      {
-      if (WiFi.status() == WL_CONNECTED)
+    case CONN_WIFI_CONNECTING:
+      if (associated)
         {
-        digitalWrite(LED_BUILTIN,LED_ON); //show we're connected
-        break;  // got it
+        wifiConnected(now);
         }
-      if (settings.debug)
-        Serial.print(".");
-      checkForCommand(); // Check for input in case something needs to be changed to work
-      ESP.wdtFeed(); //feed the watchdog timers.
-      delay(500);
-      }
+      else if (fastConnectAttempt && now-connectionTimer>=FAST_CONNECT_TIMEOUT_MS)
+        {
+        //The AP may have moved or the address may be gone. Forget it
+        //and do it the slow way right now.
+        Serial.println(F("Fast connect failed, trying a normal connection."));
+        settings.fastCache.valid=0;
+        startWiFi();
+        connectionTimer=now;
+        }
+      else if (now-connectionTimer>=WIFI_CONNECT_TIMEOUT_MS) //can't connect to wifi, try again later
+        {
+        wifiBackoff=nextBackoff(wifiBackoff);
+        Serial.print(F("Wifi status is "));
+        Serial.println(WiFi.status());
+        Serial.print(F("WiFi connection unsuccessful, will try again in "));
+        Serial.print(wifiBackoff);
+        Serial.println(F(" ms"));
+        digitalWrite(LED_BUILTIN,LED_OFF); //stay off until we connect
+        connectionTimer=now;
+        connectionState=CONN_WIFI_DOWN;
+        }
+      break;
 
-    if (WiFi.status() == WL_CONNECTED)
-      {
-      digitalWrite(LED_BUILTIN,LED_ON); //show we're connected
-      if (settings.debug)
+    case CONN_MQTT_DOWN:
+      if (now-connectionTimer>=mqttBackoff)
         {
-        Serial.println(F("Connected to network."));
-        Serial.println();
+        if (reconnect())
+          {
+          mqttBackoff=CONNECT_BACKOFF_MIN_MS;
+          connectionState=CONN_MQTT_CONNECTED;
+          mqttConnectCount++;
+          qos1Reconnected(); //send anything the broker hasn't acknowledged again
+          if (mqttConnectCount>1)
+            eventLog(EVENT_RECONNECT);
+          publishHoldUntil=now+jitter(PUBLISH_JITTER_MS); //don't all report in at once
+          triggerTask(rssiTask,publishHoldUntil); //let them know how we're doing
+          }
+        else
+          {
+          mqttBackoff=nextBackoff(mqttBackoff);
+          Serial.print(F("Will try again in "));
+          Serial.print(mqttBackoff);
+          Serial.println(F(" ms"));
+          connectionTimer=myMillis(); //reconnect() may have taken a little while
+          }
         }
-      //show the IP address
-      Serial.println(WiFi.localIP());
-      retval=true;
-      }     
-    else //can't connect to wifi, try again next time
-      {
-      retval=false;
-      Serial.print("Wifi status is ");
-      Serial.println(WiFi.status());
-      Serial.println(F("WiFi connection unsuccessful."));
-      digitalWrite(LED_BUILTIN,LED_OFF); //stay off until we connect
-      }
-    }
-  if (WiFi.status() == WL_CONNECTED)
-    {
-    reconnect(); // go ahead and connect to the MQTT broker
+      break;
+
+    case CONN_MQTT_CONNECTED:
+      if (!mqttClient.connected())
+        {
+        Serial.println(F("Lost connection to MQTT broker."));
+        mqttBackoff=jitter(CONNECT_JITTER_MS); //the broker may have dropped everybody
+        connectionTimer=now;
+        connectionState=CONN_MQTT_DOWN;
+        }
+      break;
     }
-  return retval;
   }
 
-void showSub(char* topic, bool subgood)
+void showSub(const char* topic, bool subgood)
   {
   if (settings.debug)
     {
-    Serial.print("++++++Subscribing to ");
+    Serial.print(F("++++++Subscribing to "));
     Serial.print(topic);
-    Serial.print(":");
+    Serial.print(':');
     Serial.println(subgood);
     }
   }
 
 
 /*
- * Reconnect to the MQTT broker
+ * Look up the broker address.  The answer is kept until a connect fails so
+ * that the DNS lookup isn't part of every attempt.
+ */
+static IPAddress brokerIp;
+static char brokerIpName[ADDRESS_SIZE]=""; //what brokerIp was looked up for
+
+boolean resolveBroker(IPAddress& ip)
+  {
+  if (ip.fromString(settings.brokerAddress))
+    return true;
+  if (brokerIp.isSet() && strcmp(brokerIpName,settings.brokerAddress)==0)
+    {
+    ip=brokerIp;
+    return true;
+    }
+  if (!WiFi.hostByName(settings.brokerAddress,ip,MQTT_DNS_TIMEOUT_MS))
+    return false;
+  brokerIp=ip;
+  strlcpy(brokerIpName,settings.brokerAddress,sizeof(brokerIpName));
+  return true;
+  }
+
+/*
+ * Make one attempt to connect to the MQTT broker. Returns true if connected.
+ * PubSubClient connects synchronously, so an attempt holds up loop() for
+ * at most MQTT_DNS_TIMEOUT_MS (only when the address isn't cached) plus
+ * MQTT_CONNECT_TIMEOUT_MS for the TCP connection plus
+ * MQTT_SOCKET_TIMEOUT_SECONDS for the CONNACK: 1.5 s worst case, 250 ms
+ * when the broker host is gone.  The cutoff runs from timer1, so a run still
+ * stops on time meanwhile.
  */
-void reconnect() 
+boolean reconnect() 
   {
-  // Loop until we're reconnected
   if (!mqttClient.connected()) 
     {      
-    Serial.print("Attempting MQTT connection...");
+    Serial.print(F("Attempting MQTT connection..."));
 
     mqttClient.setBufferSize(500); //default (256) isn't big enough
-    mqttClient.setServer(settings.brokerAddress, settings.brokerPort);
+    #ifdef BENCHMARK_MODE
+    if (benchBrokerBlocked())
+      mqttClient.setServer(BENCH_UNREACHABLE_BROKER, settings.brokerPort);
+    else
+    #endif
+      {
+      IPAddress ip;
+      if (!resolveBroker(ip))
+        {
+        Serial.println(F("can't look up the broker address."));
+        return false;
+        }
+      mqttClient.setServer(ip, settings.brokerPort);
+      }
     mqttClient.setCallback(incomingMqttHandler);
+    mqttClient.setSocketTimeout(MQTT_SOCKET_TIMEOUT_SECONDS);
+    wifiClient.setTimeout(MQTT_CONNECT_TIMEOUT_MS);
     
     // Attempt to connect
-    char willTopic[MQTT_MAX_TOPIC_SIZE]="";
-    strcpy(willTopic,settings.mqttTopicRoot);
-    strcat(willTopic,MQTT_TOPIC_STATUS);
-
-
+    char lwt[LIMITER_MESSAGE_SIZE];
+    renderTemplate(lwt,sizeof(lwt),settings.mqttLWTMessage,messageResolver,NULL);
     if (mqttClient.connect(settings.mqttClientId,
                           settings.mqttUsername,
                           settings.mqttUserPassword,
-                          willTopic,
-                          0,                  //QOS
+                          topics.status[0],   //will topic
+                          1,                  //QOS
                           true,               //retain
-                          settings.mqttLWTMessage))
+                          lwt))
       {
-      Serial.println("connected to MQTT broker.");
+      Serial.println(F("connected to MQTT broker."));
 
       //resubscribe to the incoming message topic
-      char topic[MQTT_MAX_TOPIC_SIZE];
-      strcpy(topic,settings.mqttTopicRoot);
-      strcat(topic,MQTT_TOPIC_COMMAND_REQUEST);
-      bool subgood=mqttClient.subscribe(topic);
-      showSub(topic,subgood);
+      bool subgood=mqttClient.subscribe(topics.command);
+      showSub(topics.command,subgood);
+      if (settings.mqttGroupTopic[0]!='\0') //and the one shared by every unit
+        showSub(settings.mqttGroupTopic,mqttClient.subscribe(settings.mqttGroupTopic));
+      #ifdef BENCHMARK_MODE
+      showSub(topics.status[0],mqttClient.subscribe(topics.status[0])); //to see our own timeout message come back
+      #endif
       }
     else 
       {
-      Serial.print("failed, rc=");
+      Serial.print(F("failed, rc="));
       Serial.println(mqttClient.state());
-      Serial.println("Will try again in a second");
-      
-      // Wait a second before retrying
-      // In the meantime check for input in case something needs to be changed to make it work
-      checkForCommand(); 
-      
-      delay(1000);
+      brokerIp=IPAddress(); //it may have moved, look it up again next time
+      return false;
       }
     }
-  mqttClient.loop(); //This has to happen every so often or we get disconnected for some reason
+  return true;
   }
 
 //Generate an MQTT client ID.  This should not be necessary very often
 char* generateMqttClientId(char* mqttId)
   {
-  strcpy(mqttId,strcat(MQTT_CLIENT_ID_ROOT,String(random(0xffff), HEX).c_str()));
+  //the chip ID keeps it unique in the fleet, the random part lets it be changed
+  snprintf(mqttId,MQTT_CLIENTID_SIZE,"%s%06x%04x",MQTT_CLIENT_ID_ROOT,
+           (unsigned int)(ESP.getChipId()&0xFFFFFF),(unsigned int)random(0x10000));
   if (settings.debug)
     {
-    Serial.print("New MQTT userid is ");
+    Serial.print(F("New MQTT userid is "));
     Serial.println(mqttId);
     }
   return mqttId;
   }
 
-void showSettings()
-  {
-  Serial.print("ssid=<wifi ssid> (");
-  Serial.print(settings.ssid);
-  Serial.println(")");
-  Serial.print("wifipass=<wifi password> (");
-  Serial.print(settings.wifiPassword);
-  Serial.println(")");
-  Serial.print("broker=<address of MQTT broker> (");
-  Serial.print(settings.brokerAddress);
-  Serial.println(")");
-  Serial.print("brokerPort=<port number MQTT broker> (");
-  Serial.print(settings.brokerPort);
-  Serial.println(")");
-  Serial.print("userName=<user ID for MQTT broker> (");
-  Serial.print(settings.mqttUsername);
-  Serial.println(")");
-  Serial.print("userPass=<user password for MQTT broker> (");
-  Serial.print(settings.mqttUserPassword);
-  Serial.println(")");
-  Serial.print("topicRoot=<MQTT topic base to which status or other topics will be added> (");
-  Serial.print(settings.mqttTopicRoot);
-  Serial.println(")");
-  Serial.print("runMessage=<status message to send when power is applied> (");
-  Serial.print(settings.mqttRunMessage);
-  Serial.println(")");
-  Serial.print("lwtMessage=<status message to send when power is removed> (");
-  Serial.print(settings.mqttLWTMessage);
-  Serial.println(")");
-  Serial.print("timeoutMessage=<status message to send when runtime is exceeded> (");
-  Serial.print(settings.mqttTimeoutMessage);
-  Serial.println(")");
-  Serial.print("maxRuntime=<maximum allowable seconds to run> (");
-  Serial.print(settings.maxRuntime);
-  Serial.println(")");
-  Serial.print("debug=<print debug messages to serial port> (");
-  Serial.print(settings.debug?"true":"false");
-  Serial.println(")");
-  Serial.print("MQTT client ID=<automatically generated client ID> (");
-  Serial.print(settings.mqttClientId);
-  Serial.println(") **Use \"resetmqttid=yes\" to regenerate");
-  Serial.println("\n*** Use \"factorydefaults=yes\" to reset all settings ***");
-  Serial.print("\nIP Address=");
-  Serial.println(WiFi.localIP());
-  }
-
 /*
- * Check for configuration input via the serial port.  Return a null string 
- * if no input is available or return the complete line otherwise.
+ * Write all of the settings as name=value lines, followed by the IP address.
+ * Passwords are masked, this goes out over MQTT.
  */
-String getConfigCommand()
+void dumpSettings(Print& out)
   {
-  if (commandComplete) 
+  settingField field;
+  for (size_t i=0;i<settingCount();i++)
     {
-    String newCommand=commandString;
-    commandString = "";
-    commandComplete = false;
-    return newCommand;
+    getSettingField(i,&field);
+    if (field.flags & FIELD_HIDDEN)
+      continue;
+    out.print('\n');
+    out.print(FPSTR(field.name));
+    out.print('=');
+    const char* value=(const char*)((const uint8_t*)&settings+field.offset);
+    if ((field.flags & FIELD_SECRET) && value[0]!='\0')
+      out.print(F("********")); //only whether it is set
+    else
+      printSettingValue(out,&field,&settings);
     }
-  else return "";
+  out.print(F("\nIP Address="));
+  out.print(WiFi.localIP());
   }
 
-bool processCommand(String cmd)
+void showSettings()
   {
-  const char *str=cmd.c_str();
-  char *val=NULL;
-  char *nme=strtok((char *)str,"=");
-  if (nme!=NULL)
-    val=strtok(NULL,"=");
-
-  char zero[]=""; //zero length string
-
-  //Get rid of the carriage return and/or linefeed. Twice because could have both.
-  if (val!=NULL && strlen(val)>0 && (val[strlen(val)-1]==13 || val[strlen(val)-1]==10))
-    val[strlen(val)-1]=0; 
-  if (val!=NULL && strlen(val)>0 && (val[strlen(val)-1]==13 || val[strlen(val)-1]==10))
-    val[strlen(val)-1]=0; 
-
-  //do it for the command as well.  Might not even have a value.
-  if (nme!=NULL && strlen(nme)>0 && (nme[strlen(nme)-1]==13 || nme[strlen(nme)-1]==10))
-    nme[strlen(nme)-1]=0; 
-  if (nme!=NULL && strlen(nme)>0 && (nme[strlen(nme)-1]==13 || nme[strlen(nme)-1]==10))
-    nme[strlen(nme)-1]=0; 
-
-  if (settings.debug)
+  settingField field;
+  for (size_t i=0;i<settingCount();i++)
     {
-    Serial.print("Processing command \"");
-    Serial.print(nme);
-    Serial.println("\"");
-    Serial.print("Length:");
-    Serial.println(strlen(nme));
-    Serial.print("Hex:");
-    Serial.println(nme[0],HEX);
-    Serial.print("Value is \"");
-    Serial.print(val);
-    Serial.println("\"\n");
+    getSettingField(i,&field);
+    if (field.flags & FIELD_HIDDEN)
+      continue;
+    Serial.print(FPSTR(field.name));
+    Serial.print(F("=<"));
+    Serial.print(FPSTR(field.help));
+    Serial.print(F("> ("));
+    printSettingValue(Serial,&field,&settings);
+    Serial.println(')');
     }
+  Serial.println(F("\n*** Use \"factorydefaults=yes\" to reset all settings ***"));
+  Serial.println(F("*** Use \"profile\" to show and reset the loop timing profile ***"));
+  Serial.print(F("\nIP Address="));
+  Serial.println(WiFi.localIP());
+  }
 
-  if (val==NULL)
-    val=zero;
-
-  if (nme==NULL || val==NULL || strlen(nme)==0) //empty string is a valid val value
-    {
-    showSettings();
-    return false;   //not a valid command, or it's missing
-    }
-  else if (strcmp(nme,"ssid")==0)
-    {
-    strcpy(settings.ssid,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"wifipass")==0)
-    {
-    strcpy(settings.wifiPassword,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"broker")==0)
-    {
-    strcpy(settings.brokerAddress,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"brokerPort")==0)
-    {
-    settings.brokerPort=atoi(val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"userName")==0)
-    {
-    strcpy(settings.mqttUsername,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"userPass")==0)
-    {
-    strcpy(settings.mqttUserPassword,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"lwtMessage")==0)
-    {
-    strcpy(settings.mqttLWTMessage,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"runMessage")==0)
-    {
-    strcpy(settings.mqttRunMessage,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"timeoutMessage")==0)
-    {
-    strcpy(settings.mqttTimeoutMessage,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"topicRoot")==0)
-    {
-    strcpy(settings.mqttTopicRoot,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"maxRuntime")==0)
-    {
-    settings.maxRuntime=atoi(val);
-    saveSettings();
-    }
-  else if ((strcmp(nme,"resetmqttid")==0)&& (strcmp(val,"yes")==0))
-    {
-    generateMqttClientId(settings.mqttClientId);
-    saveSettings();
-    }
-  else if (strcmp(nme,"debug")==0)
-    {
-    settings.debug=strcmp(val,"false")==0?false:true;
-    saveSettings();
-    }
-  else if ((strcmp(nme,"factorydefaults")==0) && (strcmp(val,"yes")==0)) //reset all eeprom settings
+/*
+ * Apply several settings at once.  They are all checked against a copy
+ * of the settings first, so either all of them take effect or none do, and
+ * the result is saved with a single flash write.  The response is written
+ * to resp.
+ */
+int processBatch(char* cmd, char* resp, size_t respSize)
+  {
+  static conf staged; //too big for the stack
+  staged=settings;
+  noteStackDepth();
+  const char* badName=NULL;
+  int count=0;
+
+  char* p=cmd;
+  while (*p==' ' || *p=='\t') p++;
+  if (*p=='{')
+    count=applyJsonBatch(&staged,p,&badName);
+  else
     {
-    Serial.println("\n*********************** Resetting EEPROM Values ************************");
-    initializeSettings();
-    saveSettings();
-    delay(2000);
-    ESP.restart();
+    char* save=NULL;
+    for (char* pair=strtok_r(cmd,";\r\n",&save);pair!=NULL;pair=strtok_r(NULL,";\r\n",&save))
+      {
+      pair=trim(pair);
+      if (*pair==0)
+        continue;
+      char* val=strchr(pair,'=');
+      if (val!=NULL)
+        *val++=0;
+      else
+        val=(char*)"";
+      if (!applySetting(&staged,trim(pair),trim(val)))
+        {
+        badName=pair;
+        count=-1;
+        break;
+        }
+      count++;
+      }
     }
-  else if ((strcmp(nme,"reset")==0) && (strcmp(val,"yes")==0)) //reset the device
+
+  if (count<0)
     {
-    Serial.println("\n*********************** Resetting Device ************************");
-    delay(1000);
-    ESP.restart();
+    if (badName)
+      snprintf(resp,respSize,"rejected, bad setting \"%s\"",badName);
+    else
+      snprintf(resp,respSize,"rejected, malformed JSON");
+    return -1;
     }
-  else
+  if (!commitStaged(&staged,count,resp,respSize))
+    return -1;
+  return count;
+  }
+
+/*
+ * Make a set of staged changes the real settings, unless that would leave
+ * a working configuration incomplete.  resp gets a message either way.
+ */
+boolean commitStaged(const conf* staged, int count, char* resp, size_t respSize)
+  {
+  if (settingsAreValid && !settingsComplete(staged))
     {
-    showSettings();
-    return false; //command not found
+    snprintf(resp,respSize,"rejected, settings would be incomplete");
+    return false;
     }
+
+  settings=*staged;
+  saveSettings();
+  eventLog(EVENT_CONFIG);
+  snprintf(resp,respSize,"OK, %d settings",count);
   return true;
   }
 
 void initializeSettings()
   {
-  settings.validConfig=0; 
-  strcpy(settings.ssid,"");
-  strcpy(settings.wifiPassword,"");
-  settings.maxRuntime=DEFAULT_MAX_RUNTIME_SECONDS;
-  strcpy(settings.brokerAddress,"");
-  settings.brokerPort=DEFAULT_MQTT_BROKER_PORT;
-  strcpy(settings.mqttLWTMessage,DEFAULT_MQTT_LWT_MESSAGE);
-  strcpy(settings.mqttRunMessage,DEFAULT_MQTT_RUN_MESSAGE);
-  strcpy(settings.mqttTimeoutMessage,DEFAULT_MQTT_TIMEOUT_MESSAGE);
-  strcpy(settings.mqttTopicRoot,DEFAULT_MQTT_TOPIC_ROOT);
-  strcpy(settings.mqttUsername,"");
-  strcpy(settings.mqttUserPassword,"");
+  initializeDefaults();
   generateMqttClientId(settings.mqttClientId);
-  settings.debug=false;
   saveSettings();
   }
 
@@ -749,63 +1896,162 @@ void checkForCommand()
   if (Serial.available())
     {
     incomingData();
-    String cmd=getConfigCommand();
-    if (cmd.length()>0)
+    if (commandComplete)
       {
-      processCommand(cmd);
+      if (commandOverflow)
+        {
+        Serial.print(F("Command too long, the limit is "));
+        Serial.print(sizeof(commandLine)-1);
+        Serial.println(F(" characters. Ignored."));
+        }
+      else if (commandLength>0)
+        {
+        if (isBatchCommand(commandLine))
+          {
+          char batchResp[60];
+          processBatch(commandLine,batchResp,sizeof(batchResp));
+          Serial.println(batchResp);
+          }
+        else
+          processCommand(commandLine,commandLength);
+        }
+      commandLength=0;
+      commandLine[0]=0;
+      commandComplete=false;
+      commandOverflow=false;
       }
     }
   }
   
 /*
-*  Initialize the settings from eeprom and determine if they are valid
+ * Copy the settings into the older whole-struct layout.  Only used 
+ * when there is no room for the settings log.
+ */
+void exportLegacySettings(legacyConf* old)
+  {
+  *old=legacyConf();
+  old->validConfig=settings.validConfig;
+  strlcpy(old->ssid,settings.ssid,sizeof(old->ssid));
+  strlcpy(old->wifiPassword,settings.wifiPassword,sizeof(old->wifiPassword));
+  strlcpy(old->brokerAddress,settings.brokerAddress,sizeof(old->brokerAddress));
+  old->brokerPort=settings.brokerPort;
+  strlcpy(old->mqttUsername,settings.mqttUsername,sizeof(old->mqttUsername));
+  strlcpy(old->mqttUserPassword,settings.mqttUserPassword,sizeof(old->mqttUserPassword));
+  strlcpy(old->mqttTopicRoot,settings.mqttTopicRoot,sizeof(old->mqttTopicRoot));
+  strlcpy(old->mqttRunMessage,settings.mqttRunMessage,sizeof(old->mqttRunMessage));
+  strlcpy(old->mqttTimeoutMessage,settings.mqttTimeoutMessage,sizeof(old->mqttTimeoutMessage));
+  strlcpy(old->mqttLWTMessage,settings.mqttLWTMessage,sizeof(old->mqttLWTMessage));
+  old->maxRuntime=settings.maxRuntime;
+  old->debug=settings.debug;
+  strlcpy(old->mqttClientId,settings.mqttClientId,sizeof(old->mqttClientId));
+  old->fastConnect=settings.fastConnect;
+  old->fastCache=settings.fastCache;
+  }
+
+/*
+ * Bring forward settings saved by older firmware as a whole struct.
+ */
+void importLegacySettings(const legacyConf* old)
+  {
+  strlcpy(settings.ssid,old->ssid,sizeof(settings.ssid));
+  strlcpy(settings.wifiPassword,old->wifiPassword,sizeof(settings.wifiPassword));
+  strlcpy(settings.brokerAddress,old->brokerAddress,sizeof(settings.brokerAddress));
+  settings.brokerPort=old->brokerPort;
+  strlcpy(settings.mqttUsername,old->mqttUsername,sizeof(settings.mqttUsername));
+  strlcpy(settings.mqttUserPassword,old->mqttUserPassword,sizeof(settings.mqttUserPassword));
+  strlcpy(settings.mqttTopicRoot,old->mqttTopicRoot,sizeof(settings.mqttTopicRoot));
+  strlcpy(settings.mqttRunMessage,old->mqttRunMessage,sizeof(settings.mqttRunMessage));
+  strlcpy(settings.mqttTimeoutMessage,old->mqttTimeoutMessage,sizeof(settings.mqttTimeoutMessage));
+  strlcpy(settings.mqttLWTMessage,old->mqttLWTMessage,sizeof(settings.mqttLWTMessage));
+  settings.maxRuntime=old->maxRuntime;
+  settings.debug=old->debug;
+  strlcpy(settings.mqttClientId,old->mqttClientId,sizeof(settings.mqttClientId));
+
+  //Settings saved by the original firmware end before the fast connect 
+  //fields, so whatever is in flash past that point can't be trusted.
+  if (old->fastCache.valid==VALID_FAST_CONNECT_FLAG)
+    {
+    settings.fastConnect=old->fastConnect;
+    settings.fastCache=old->fastCache;
+    }
+  else
+    {
+    settings.fastConnect=false;
+    settings.fastCache.valid=0;
+    }
+  settings.validConfig=old->validConfig;
+  }
+
+/*
+*  Initialize the settings from flash and determine if they are valid.
+*  They come from the settings log if there is one.  The first time this
+*  firmware runs the log may have nothing in the current format, so they 
+*  are picked up from an older whole-struct record or from EEPROM where
+*  older firmware left them.
 */
 void loadSettings()
   {
-  EEPROM.get(0,settings);
+  size_t length=0;
+  if (useSettingsLog)
+    length=storeRead(STORE_RECORD_SETTINGS_FIELDS,settingsRecord,sizeof(settingsRecord));
+
+  if (length>0)
+    {
+    if (length>sizeof(settingsRecord))
+      length=sizeof(settingsRecord);
+    initializeDefaults();
+    unpackSettings(&settings,length);
+    settings.validConfig=settingsComplete(&settings)?VALID_SETTINGS_FLAG:0;
+    }
+  else
+    {
+    static legacyConf old; //too big for the stack
+    if (!useSettingsLog || storeRead(STORE_RECORD_SETTINGS,&old,sizeof(old))!=sizeof(old))
+      {
+      EEPROM.begin(sizeof(old)); //fire up the eeprom section of flash
+      EEPROM.get(0,old);
+      EEPROM.end(); //don't need the RAM copy any more
+      }
+    importLegacySettings(&old);
+    if (useSettingsLog && settings.validConfig==VALID_SETTINGS_FLAG)
+      {
+      Serial.println(F("Moving settings to the new format."));
+      settingsDirty=true; //write them out on the first pass through loop()
+      }
+    }
+
+  buildTopics();
+
   if (settings.validConfig==VALID_SETTINGS_FLAG)    //skip loading stuff if it's never been written
     {
     settingsAreValid=true;
     if (settings.debug)
-      Serial.println("Loaded configuration values from EEPROM");
+      Serial.println(F("Loaded configuration values from flash"));
     }
   else
     {
-    Serial.println("Skipping load from EEPROM, device not configured.");    
+    Serial.println(F("Skipping load from flash, device not configured."));    
     settingsAreValid=false;
     }
   }
 
 /*
- * Save the settings to EEPROM. Set the valid flag if everything is filled in.
+ * Validate the settings and schedule them to be written to flash. Set the
+ * valid flag if everything is filled in.  The write itself is done by
+ * commitSettings() from loop() a little later, so that a burst of 
+ * changes only costs one flash write.
  */
 boolean saveSettings()
   {
-  if (strlen(settings.ssid)>0 &&
-    strlen(settings.ssid)<=SSID_SIZE &&
-    strlen(settings.wifiPassword)>0 &&
-    strlen(settings.wifiPassword)<=PASSWORD_SIZE &&
-    strlen(settings.brokerAddress)>0 &&
-    strlen(settings.brokerAddress)<ADDRESS_SIZE &&
-    strlen(settings.mqttLWTMessage)>0 &&
-    strlen(settings.mqttLWTMessage)<MQTT_MAX_MESSAGE_SIZE &&
-    strlen(settings.mqttRunMessage)>0 &&
-    strlen(settings.mqttRunMessage)<MQTT_MAX_MESSAGE_SIZE &&
-    strlen(settings.mqttTimeoutMessage)>0 &&
-    strlen(settings.mqttTimeoutMessage)<MQTT_MAX_MESSAGE_SIZE &&
-    strlen(settings.mqttTopicRoot)>0 &&
-    strlen(settings.mqttTopicRoot)<MQTT_MAX_TOPIC_SIZE &&
-    settings.brokerPort>0 &&
-    settings.brokerPort<65535 &&
-    settings.maxRuntime>0)
-    {
-    Serial.println("Settings deemed complete.");
+  if (settingsComplete(&settings))
+    {
+    Serial.println(F("Settings deemed complete."));
     settings.validConfig=VALID_SETTINGS_FLAG;
     settingsAreValid=true;
     }
   else
     {
-    Serial.println("Settings still incomplete");
+    Serial.println(F("Settings still incomplete"));
     settings.validConfig=0;
     settingsAreValid=false;
     }
@@ -818,11 +2064,48 @@ boolean saveSettings()
 
   //The topic root needs to end with a slash (/).
   //Ensure that it does.
-  if (settings.mqttTopicRoot[strlen(settings.mqttTopicRoot)-1]!='/')
+  size_t rootLength=strlen(settings.mqttTopicRoot);
+  if ((rootLength==0 || settings.mqttTopicRoot[rootLength-1]!='/')
+      && rootLength<sizeof(settings.mqttTopicRoot)-1)
     strcat(settings.mqttTopicRoot,"/");
+  buildTopics();
+  setTaskPeriod(telemetryTask,settings.telemetryInterval*1000UL);
+  dutyConfigure(settings.dutyWindow,settings.dutyAllowed);
+  cycleConfigure(settings.shortCycleOff,settings.shortCycleCount);
+
+  settingsDirty=true;
+  settingsCommitTime=myMillis()+STORE_COMMIT_DELAY_MS;
+  return true;
+  }
 
-  EEPROM.put(0,settings);
-  return EEPROM.commit();
+/*
+ * Write the settings to flash if they have changed.
+ */
+boolean commitSettings()
+  {
+  if (!settingsDirty)
+    return true;
+  settingsDirty=false;
+  boolean success;
+  if (useSettingsLog)
+    {
+    success=storeWrite(STORE_RECORD_SETTINGS_FIELDS,settingsRecord,packSettings(&settings));
+    }
+  else
+    {
+    //no room for the log, save it the way the original firmware did
+    static legacyConf old;
+    exportLegacySettings(&old);
+    EEPROM.begin(sizeof(old));
+    EEPROM.put(0,old);
+    success=EEPROM.commit();
+    EEPROM.end();
+    }
+  if (!success)
+    Serial.println(F("************ Failed to write settings to flash!"));
+  else if (settings.debug)
+    Serial.println(F("Settings written to flash."));
+  return success;
   }
 
 /*
@@ -830,25 +2113,35 @@ boolean saveSettings()
   routine is run between each time loop() runs, so using delay inside loop can
   delay response. Multiple bytes of data may be available.
 */
+/*
+ * Move what has arrived on the serial port into the command line, up to the
+ * end of the line.  Anything after that stays in the UART receive ring for
+ * the next pass, so a pasted configuration is taken one command per pass.
+ * The echo goes out in one write and only as much as the transmit FIFO has
+ * room for, so it never makes loop() wait on the serial port.
+ */
 void incomingData() 
   {
-  while (Serial.available()) 
+  unsigned int start=commandLength; //echo from here
+  while (!commandComplete && Serial.available()) 
     {
-    // get the new byte
     char inChar = (char)Serial.read();
-    Serial.print(inChar);
 
     // if the incoming character is a newline, set a flag so the main loop can
     // do something about it 
     if (inChar == '\n') 
-      {
       commandComplete = true;
-      }
+    else if (commandLength<sizeof(commandLine)-1)
+      commandLine[commandLength++]=inChar; // add it to the command line
     else
-      {
-      // add it to the inputString 
-      commandString += inChar;
-      }
+      commandOverflow = true;
     }
+  commandLine[commandLength]=0;
+
+  size_t added=commandLength-start;
+  size_t room=Serial.availableForWrite();
+  Serial.write(commandLine+start,added<room?added:room);
+  if (commandComplete && room>added)
+    Serial.write('\n');
   }
 
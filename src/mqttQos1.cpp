@@ -0,0 +1,155 @@
+/*
+ * QoS 1 publishing.  See mqttQos1.h.
+ */
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+#include "hal.h"
+#include "mqttQos1.h"
+
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_FLAG_DUP 0x08
+#define MQTT_FLAG_QOS1 0x02
+#define MQTT_FLAG_RETAIN 0x01
+
+typedef struct
+  {
+  uint16_t packetId;   //0 if the slot is free
+  bool retain;
+  bool sendNow;        //send it on the next service call
+  unsigned long sentAt; //millis() time of the last send
+  char topic[QOS1_TOPIC_SIZE];
+  char payload[QOS1_PAYLOAD_SIZE];
+  } inflightMessage;
+
+static inflightMessage inflight[QOS1_INFLIGHT];
+static WiFiClient* connection=NULL;
+static uint16_t lastPacketId=0;
+
+void qos1Begin(WiFiClient& client)
+  {
+  connection=&client;
+  memset(inflight,0,sizeof(inflight));
+  }
+
+/*
+ * Write one PUBLISH packet.  Returns false if the connection didn't take
+ * all of it.
+ */
+static bool sendPacket(const inflightMessage* message, bool dup)
+  {
+  size_t topicLength=strlen(message->topic);
+  size_t payloadLength=strlen(message->payload);
+  size_t remaining=2+topicLength+2+payloadLength; //topic length, topic, packet ID, payload
+
+  uint8_t header[7];
+  size_t len=0;
+  header[len++]=MQTT_PUBLISH|MQTT_FLAG_QOS1|(dup?MQTT_FLAG_DUP:0)|(message->retain?MQTT_FLAG_RETAIN:0);
+  do
+    {
+    uint8_t digit=remaining%128;
+    remaining/=128;
+    header[len++]=remaining>0?digit|0x80:digit;
+    } while (remaining>0);
+  header[len++]=topicLength>>8;
+  header[len++]=topicLength&0xFF;
+
+  uint8_t id[2]={(uint8_t)(message->packetId>>8),(uint8_t)(message->packetId&0xFF)};
+  return connection->write(header,len)==len
+         && connection->write((const uint8_t*)message->topic,topicLength)==topicLength
+         && connection->write(id,sizeof(id))==sizeof(id)
+         && connection->write((const uint8_t*)message->payload,payloadLength)==payloadLength;
+  }
+
+/*
+ * Publish at QoS 1.  Returns the packet ID to check with qos1Delivered(),
+ * or 0 if the message can't be taken right now.
+ */
+uint16_t qos1Publish(const char* topic, const char* payload, bool retain)
+  {
+  if (connection==NULL || !halConnected()
+      || strlen(topic)>=QOS1_TOPIC_SIZE || strlen(payload)>=QOS1_PAYLOAD_SIZE)
+    return 0;
+  inflightMessage* message=NULL;
+  for (int i=0;i<QOS1_INFLIGHT;i++)
+    {
+    if (inflight[i].packetId==0)
+      {
+      message=&inflight[i];
+      break;
+      }
+    }
+  if (message==NULL)
+    return 0; //all the slots are waiting
+
+  lastPacketId=QOS1_PACKET_ID_BASE|((lastPacketId+1)&~QOS1_PACKET_ID_BASE); //never 0, which isn't a valid ID
+  message->packetId=lastPacketId;
+  message->retain=retain;
+  strcpy(message->topic,topic);
+  strcpy(message->payload,payload);
+  message->sentAt=millis();
+  message->sendNow=!sendPacket(message,false); //try again on the next service call if it didn't go
+  return message->packetId;
+  }
+
+/*
+ * True once the broker has acknowledged the message.
+ */
+bool qos1Delivered(uint16_t packetId)
+  {
+  for (int i=0;i<QOS1_INFLIGHT;i++)
+    {
+    if (inflight[i].packetId==packetId)
+      return false;
+    }
+  return true;
+  }
+
+/*
+ * Call from loop() before mqttClient.loop().  Takes any PUBACK for one of
+ * our IDs waiting at the front of the incoming data and resends whatever
+ * is overdue.
+ */
+void qos1Service()
+  {
+  if (connection==NULL)
+    return;
+  uint8_t ack[4];
+  while (connection->available()>=(int)sizeof(ack)
+         && connection->peekBytes(ack,sizeof(ack))==sizeof(ack)
+         && ack[0]==MQTT_PUBACK && ack[1]==2
+         && (ack[2]&(QOS1_PACKET_ID_BASE>>8))) //one of ours, not PubSubClient's
+    {
+    connection->read(ack,sizeof(ack));
+    uint16_t packetId=(ack[2]<<8)|ack[3];
+    for (int i=0;i<QOS1_INFLIGHT;i++)
+      {
+      if (inflight[i].packetId==packetId)
+        inflight[i].packetId=0;
+      }
+    }
+
+  if (!halConnected())
+    return; //retransmits don't wait for the publish hold either
+  unsigned long now=millis();
+  for (int i=0;i<QOS1_INFLIGHT;i++)
+    {
+    inflightMessage* message=&inflight[i];
+    if (message->packetId!=0 && (message->sendNow || now-message->sentAt>=QOS1_RETRY_MS))
+      {
+      message->sentAt=now;
+      message->sendNow=!sendPacket(message,true);
+      }
+    }
+  }
+
+/*
+ * The broker connection was just made again.  Anything still waiting goes
+ * out on the next service call.
+ */
+void qos1Reconnected()
+  {
+  for (int i=0;i<QOS1_INFLIGHT;i++)
+    inflight[i].sendNow=true;
+  }
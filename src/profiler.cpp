@@ -0,0 +1,117 @@
+/*
+ * Loop profiler.  See profiler.h.
+ */
+#include <Arduino.h>
+
+#include "profiler.h"
+
+typedef struct
+  {
+  uint32_t count;
+  uint32_t maxCycles;
+  uint64_t totalCycles;
+  uint32_t buckets[PROFILE_BUCKETS];
+  } profileStats;
+
+static profileStats stats[PROFILE_STAGES];
+
+static const char stageLoop[] PROGMEM = "loop";
+static const char stageConnection[] PROGMEM = "connection";
+static const char stageMqtt[] PROGMEM = "mqtt";
+static const char stageCommand[] PROGMEM = "command";
+static const char stageOta[] PROGMEM = "ota";
+static const char stageWeb[] PROGMEM = "web";
+static const char stageCutoff[] PROGMEM = "cutoff";
+static const char stageTasks[] PROGMEM = "tasks";
+
+static const char* const stageNames[PROFILE_STAGES] PROGMEM =
+  {
+  stageLoop,
+  stageConnection,
+  stageMqtt,
+  stageCommand,
+  stageOta,
+  stageWeb,
+  stageCutoff,
+  stageTasks
+  };
+
+/*
+ * Add one measurement.  Cycle counter wrap is harmless as long as the stage
+ * took less than one wrap (about 53 seconds at 80MHz).
+ */
+void profileRecord(uint8_t stage, uint32_t startCycles)
+  {
+  uint32_t cycles=ESP.getCycleCount()-startCycles;
+  profileStats* s=&stats[stage];
+  uint32_t us=cycles/ESP.getCpuFreqMHz();
+  uint8_t bucket=us==0?0:32-__builtin_clz(us); //smallest n with us < 2^n
+  if (bucket>=PROFILE_BUCKETS)
+    bucket=PROFILE_BUCKETS-1;
+  s->buckets[bucket]++;
+  s->count++;
+  s->totalCycles+=cycles;
+  if (cycles>s->maxCycles)
+    s->maxCycles=cycles;
+  }
+
+/*
+ * Upper bound of the bucket holding the 99th percentile, in microseconds.
+ * The last bucket has no upper bound so the worst case is given instead.
+ */
+static uint32_t percentile99(const profileStats* s)
+  {
+  uint32_t threshold=s->count-s->count/100;
+  uint32_t seen=0;
+  for (uint8_t bucket=0;bucket<PROFILE_BUCKETS-1;bucket++)
+    {
+    seen+=s->buckets[bucket];
+    if (seen>=threshold)
+      return 1UL<<bucket;
+    }
+  return s->maxCycles/ESP.getCpuFreqMHz();
+  }
+
+/*
+ * Print one line per stage: the number of samples, then the average, 99th
+ * percentile and worst case times in microseconds, then the non-empty
+ * histogram buckets as <limit>:<count>.
+ */
+void profileDump(Print& out)
+  {
+  uint32_t mhz=ESP.getCpuFreqMHz();
+  out.print(F("stage count avg p99 max (us)"));
+  for (uint8_t stage=0;stage<PROFILE_STAGES;stage++)
+    {
+    const profileStats* s=&stats[stage];
+    out.print('\n');
+    out.print(FPSTR((const char*)pgm_read_ptr(&stageNames[stage])));
+    out.print(' ');
+    out.print(s->count);
+    if (s->count==0)
+      continue;
+    out.print(' ');
+    out.print((uint32_t)(s->totalCycles/s->count/mhz));
+    out.print(' ');
+    out.print(percentile99(s));
+    out.print(' ');
+    out.print(s->maxCycles/mhz);
+    for (uint8_t bucket=0;bucket<PROFILE_BUCKETS;bucket++)
+      {
+      if (s->buckets[bucket]==0)
+        continue;
+      out.print(' ');
+      if (bucket==PROFILE_BUCKETS-1)
+        out.print('+');
+      out.print(1UL<<(bucket==PROFILE_BUCKETS-1?bucket-1:bucket));
+      out.print(':');
+      out.print(s->buckets[bucket]);
+      }
+    }
+  out.print('\n');
+  }
+
+void profileReset()
+  {
+  memset(stats,0,sizeof(stats));
+  }
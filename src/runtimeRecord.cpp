@@ -0,0 +1,109 @@
+/*
+ * Runtime carried across resets.  See runtimeRecord.h.
+ */
+#include <Arduino.h>
+#include <coredecls.h>
+
+#include "rtcMemory.h"
+#include "runtimeRecord.h"
+
+typedef struct
+  {
+  uint16_t magic;      //RUNTIME_RECORD_MAGIC
+  uint16_t resets;     //warm resets since the run started
+  uint32_t reason;     //rst_info reason for the most recent one
+  uint64_t used[RUNTIME_CHANNELS]; //milliseconds of runtime used, including earlier boots
+  uint8_t exhausted;   //bit per channel, the run had timed out
+  uint8_t reserved[3];
+  uint32_t crc;        //crc32 of everything above
+  } runtimeStore;
+
+static runtimeStore record;
+static uint64_t usedBeforeBoot[RUNTIME_CHANNELS]; //record.used as it was when we started
+
+static void saveRecord()
+  {
+  record.crc=crc32(&record,offsetof(runtimeStore,crc));
+  ESP.rtcUserMemoryWrite(RTC_RUNTIME_BLOCK,(uint32_t*)&record,sizeof(record));
+  }
+
+/*
+ * Read the record left by the previous boot.  Returns true if this boot
+ * is continuing a run that was already under way.
+ */
+bool runtimeBegin()
+  {
+  uint32_t reason=ESP.getResetInfoPtr()->reason;
+  bool resumed=ESP.rtcUserMemoryRead(RTC_RUNTIME_BLOCK,(uint32_t*)&record,sizeof(record))
+               && record.magic==RUNTIME_RECORD_MAGIC
+               && record.crc==crc32(&record,offsetof(runtimeStore,crc));
+  if (resumed)
+    record.resets++;
+  else
+    {
+    memset(&record,0,sizeof(record));
+    record.magic=RUNTIME_RECORD_MAGIC;
+    }
+  record.reason=reason;
+  memcpy(usedBeforeBoot,record.used,sizeof(usedBeforeBoot));
+  saveRecord();
+  return resumed;
+  }
+
+/*
+ * Milliseconds of runtime the channel used in earlier boots in this run.
+ */
+uint64_t runtimeUsed(int channel)
+  {
+  return usedBeforeBoot[channel];
+  }
+
+bool runtimeExhausted(int channel)
+  {
+  return (record.exhausted>>channel)&1;
+  }
+
+uint16_t runtimeResets()
+  {
+  return record.resets;
+  }
+
+uint32_t runtimeResetReason()
+  {
+  return record.reason;
+  }
+
+/*
+ * Note the runtime a channel has used so far.  used is milliseconds of it
+ * in this boot.
+ */
+void runtimeSave(int channel, uint64_t used, bool timedOut)
+  {
+  record.used[channel]=usedBeforeBoot[channel]+used;
+  if (timedOut)
+    record.exhausted|=1<<channel;
+  else
+    record.exhausted&=~(1<<channel);
+  saveRecord();
+  }
+
+/*
+ * The channel's run ended without timing out, so the next one gets the
+ * whole budget.
+ */
+void runtimeRestart(int channel)
+  {
+  usedBeforeBoot[channel]=0;
+  record.used[channel]=0;
+  record.exhausted&=~(1<<channel);
+  saveRecord();
+  }
+
+/*
+ * Forget the run, so the next boot gets the whole budget.
+ */
+void runtimeClear()
+  {
+  record.magic=0;
+  saveRecord();
+  }
@@ -0,0 +1,581 @@
+/*
+ * The settings table and the code driven by it.  See settings.h.
+ */
+#include <Arduino.h>
+#include <pgmspace.h>
+
+#include "runLimiter.h"
+#include "settings.h"
+#include "profiler.h"
+#include "eventQueue.h"
+#include "runtimeRecord.h"
+#include "cycleLog.h"
+#include "wallClock.h"
+
+extern conf settings;
+
+// The settings schema.  Every field of the settings struct is described once
+// here, and showing, dumping, parsing, validating, defaulting and saving the
+// settings are all driven from this table.  The table and its strings are 
+// kept in flash.  The id is what the field is saved under, so never reuse 
+// or renumber one.
+static const char nameSsid[] PROGMEM = "ssid";
+static const char helpSsid[] PROGMEM = "wifi ssid";
+static const char nameWifiPass[] PROGMEM = "wifipass";
+static const char helpWifiPass[] PROGMEM = "wifi password";
+static const char nameBroker[] PROGMEM = "broker";
+static const char helpBroker[] PROGMEM = "address of MQTT broker";
+static const char nameBrokerPort[] PROGMEM = "brokerPort";
+static const char helpBrokerPort[] PROGMEM = "port number MQTT broker";
+static const char defBrokerPort[] PROGMEM = STRINGIFY(DEFAULT_MQTT_BROKER_PORT);
+static const char nameUserName[] PROGMEM = "userName";
+static const char helpUserName[] PROGMEM = "user ID for MQTT broker";
+static const char nameUserPass[] PROGMEM = "userPass";
+static const char helpUserPass[] PROGMEM = "user password for MQTT broker";
+static const char nameTopicRoot[] PROGMEM = "topicRoot";
+static const char helpTopicRoot[] PROGMEM = "MQTT topic base to which status or other topics will be added";
+static const char defTopicRoot[] PROGMEM = DEFAULT_MQTT_TOPIC_ROOT;
+static const char nameRunMessage[] PROGMEM = "runMessage";
+static const char helpRunMessage[] PROGMEM = "status message to send when power is applied, can use {id} {channel} {runtime} {remaining} {uptime} {rssi} {ip} {reset} {cycles} {ts}";
+static const char defRunMessage[] PROGMEM = DEFAULT_MQTT_RUN_MESSAGE;
+static const char nameLwtMessage[] PROGMEM = "lwtMessage";
+static const char helpLwtMessage[] PROGMEM = "status message to send when power is removed, filled in when the broker connects";
+static const char defLwtMessage[] PROGMEM = DEFAULT_MQTT_LWT_MESSAGE;
+static const char nameTimeoutMessage[] PROGMEM = "timeoutMessage";
+static const char helpTimeoutMessage[] PROGMEM = "status message to send when runtime is exceeded, same fields as runMessage";
+static const char defTimeoutMessage[] PROGMEM = DEFAULT_MQTT_TIMEOUT_MESSAGE;
+static const char nameMaxRuntime[] PROGMEM = "maxRuntime";
+static const char helpMaxRuntime[] PROGMEM = "maximum allowable seconds to run";
+static const char defMaxRuntime[] PROGMEM = STRINGIFY(DEFAULT_MAX_RUNTIME_SECONDS);
+static const char nameMaxRuntime2[] PROGMEM = "maxRuntime2";
+static const char helpMaxRuntime2[] PROGMEM = "maximum allowable seconds to run on channel 2";
+static const char nameMaxRuntime3[] PROGMEM = "maxRuntime3";
+static const char helpMaxRuntime3[] PROGMEM = "maximum allowable seconds to run on channel 3";
+static const char nameNtpServer[] PROGMEM = "ntpServer";
+static const char helpNtpServer[] PROGMEM = "SNTP server for message timestamps, empty for none, takes effect on restart";
+static const char defNtpServer[] PROGMEM = DEFAULT_NTP_SERVER;
+static const char nameOtaPassword[] PROGMEM = "otaPassword";
+static const char helpOtaPassword[] PROGMEM = "password for OTA updates or its MD5 in hex, empty to use wifipass, no OTA without one, takes effect on restart";
+static const char nameOtaValidate[] PROGMEM = "otaValidate";
+static const char helpOtaValidate[] PROGMEM = "seconds a newly flashed image has to reach the broker, 0 for no check";
+static const char defOtaValidate[] PROGMEM = STRINGIFY(DEFAULT_OTA_VALIDATE_SECONDS);
+static const char nameGroupTopic[] PROGMEM = "groupTopic";
+static const char helpGroupTopic[] PROGMEM = "full MQTT topic for commands to all units, empty for none";
+static const char nameRunSense[] PROGMEM = "runSense";
+static const char helpRunSense[] PROGMEM = "0 time from power-up, 1 time while the sense input is high, 2 while it is low, takes effect on restart";
+static const char nameDebug[] PROGMEM = "debug";
+static const char helpDebug[] PROGMEM = "print debug messages to serial port";
+static const char nameFastConnect[] PROGMEM = "fastConnect";
+static const char helpFastConnect[] PROGMEM = "reconnect using the last AP, channel and IP address";
+static const char nameClientId[] PROGMEM = "clientId";
+static const char helpClientId[] PROGMEM = "automatically generated MQTT client ID, use \"resetmqttid=yes\" to regenerate";
+static const char nameFastCache[] PROGMEM = "fastCache";
+static const char nameTelemetryInterval[] PROGMEM = "telemetryInterval";
+static const char helpTelemetryInterval[] PROGMEM = "seconds between telemetry reports, 0 for none";
+static const char nameDutyWindow[] PROGMEM = "dutyWindow";
+static const char helpDutyWindow[] PROGMEM = "seconds in the duty cycle window, 0 for no duty cycle limit";
+static const char nameDutyAllowed[] PROGMEM = "dutyAllowed";
+static const char helpDutyAllowed[] PROGMEM = "seconds of runtime allowed in the duty cycle window";
+static const char nameShortCycleOff[] PROGMEM = "shortCycleOff";
+static const char helpShortCycleOff[] PROGMEM = "seconds off below which a power cycle is short, 0 for no alerts";
+static const char nameShortCycleCount[] PROGMEM = "shortCycleCount";
+static const char helpShortCycleCount[] PROGMEM = "short cycles among the last " STRINGIFY(CYCLE_HISTORY) " to raise an alert";
+static const char defShortCycleCount[] PROGMEM = "3";
+static const char namePowerSave[] PROGMEM = "powerSave";
+static const char helpPowerSave[] PROGMEM = "0 always awake, 1 modem sleep, 2 light sleep while waiting for the timeout";
+static const char defZero[] PROGMEM = "0";
+static const char defFalse[] PROGMEM = "false";
+static const char defEmpty[] PROGMEM = "";
+
+#define FIELD_SIZE(f) (sizeof(((conf*)0)->f))
+#define FIELD(f) offsetof(conf,f),FIELD_SIZE(f)
+static const settingField settingFields[] PROGMEM =
+  {
+  //id name                 help                 type          where                    min max                          default            flags
+  { 1, nameSsid,            helpSsid,            FIELD_STRING, FIELD(ssid),               1, FIELD_SIZE(ssid)-1,          defEmpty,          FIELD_CLEARS_FAST_CACHE|FIELD_UNIT_ONLY},
+  { 2, nameWifiPass,        helpWifiPass,        FIELD_STRING, FIELD(wifiPassword),       1, FIELD_SIZE(wifiPassword)-1,  defEmpty,          FIELD_CLEARS_FAST_CACHE|FIELD_SECRET|FIELD_UNIT_ONLY},
+  { 3, nameBroker,          helpBroker,          FIELD_STRING, FIELD(brokerAddress),      1, FIELD_SIZE(brokerAddress)-1, defEmpty,          FIELD_UNIT_ONLY},
+  { 4, nameBrokerPort,      helpBrokerPort,      FIELD_INT,    FIELD(brokerPort),         1, 65534,                       defBrokerPort,     FIELD_UNIT_ONLY},
+  { 5, nameUserName,        helpUserName,        FIELD_STRING, FIELD(mqttUsername),       0, FIELD_SIZE(mqttUsername)-1,  defEmpty,          FIELD_UNIT_ONLY},
+  { 6, nameUserPass,        helpUserPass,        FIELD_STRING, FIELD(mqttUserPassword),   0, FIELD_SIZE(mqttUserPassword)-1, defEmpty,       FIELD_SECRET|FIELD_UNIT_ONLY},
+  { 7, nameTopicRoot,       helpTopicRoot,       FIELD_STRING, FIELD(mqttTopicRoot),      1, FIELD_SIZE(mqttTopicRoot)-2, defTopicRoot,      FIELD_ADDS_SLASH|FIELD_UNIT_ONLY}, //leave room for the slash
+  { 8, nameRunMessage,      helpRunMessage,      FIELD_STRING, FIELD(mqttRunMessage),     1, FIELD_SIZE(mqttRunMessage)-1, defRunMessage,    0},
+  { 9, nameLwtMessage,      helpLwtMessage,      FIELD_STRING, FIELD(mqttLWTMessage),     1, FIELD_SIZE(mqttLWTMessage)-1, defLwtMessage,    0},
+  {10, nameTimeoutMessage,  helpTimeoutMessage,  FIELD_STRING, FIELD(mqttTimeoutMessage), 1, FIELD_SIZE(mqttTimeoutMessage)-1, defTimeoutMessage, 0},
+  {11, nameMaxRuntime,      helpMaxRuntime,      FIELD_UINT,   FIELD(maxRuntime),         1, 4000000,                     defMaxRuntime,     0},
+  {12, nameDebug,           helpDebug,           FIELD_BOOL,   FIELD(debug),              0, 1,                           defFalse,          0},
+  {13, nameFastConnect,     helpFastConnect,     FIELD_BOOL,   FIELD(fastConnect),        0, 1,                           defFalse,          FIELD_CLEARS_FAST_CACHE|FIELD_UNIT_ONLY},
+  {14, nameClientId,        helpClientId,        FIELD_STRING, FIELD(mqttClientId),       0, FIELD_SIZE(mqttClientId)-1,  defEmpty,          FIELD_READ_ONLY},
+  {15, nameFastCache,       NULL,                FIELD_BLOB,   FIELD(fastCache),          0, 0,                           NULL,              FIELD_HIDDEN},
+  {16, nameTelemetryInterval, helpTelemetryInterval, FIELD_UINT, FIELD(telemetryInterval),  0, 86400,                       defZero,           0},
+  {17, nameDutyWindow,      helpDutyWindow,      FIELD_UINT,   FIELD(dutyWindow),         0, 604800,                      defZero,           0},
+  {18, nameDutyAllowed,     helpDutyAllowed,     FIELD_UINT,   FIELD(dutyAllowed),        0, 604800,                      defZero,           0},
+  {19, nameShortCycleOff,   helpShortCycleOff,   FIELD_UINT,   FIELD(shortCycleOff),      0, CYCLE_UNKNOWN-1,             defZero,           0},
+  {20, nameShortCycleCount, helpShortCycleCount, FIELD_UINT,   FIELD(shortCycleCount),    1, CYCLE_HISTORY+1,             defShortCycleCount, 0},
+  {21, namePowerSave,       helpPowerSave,       FIELD_UINT,   FIELD(powerSave),          0, POWER_SAVE_LIGHT,            defZero,           0},
+#if CHANNEL_COUNT>1
+  {22, nameMaxRuntime2,     helpMaxRuntime2,     FIELD_UINT,   FIELD(maxRuntime2),        1, 4000000,                     defMaxRuntime,     0},
+#endif
+#if CHANNEL_COUNT>2
+  {23, nameMaxRuntime3,     helpMaxRuntime3,     FIELD_UINT,   FIELD(maxRuntime3),        1, 4000000,                     defMaxRuntime,     0},
+#endif
+  {24, nameRunSense,        helpRunSense,        FIELD_UINT,   FIELD(runSense),           0, RUN_SENSE_LOW,               defZero,           0},
+  {25, nameNtpServer,       helpNtpServer,       FIELD_STRING, FIELD(ntpServer),          0, FIELD_SIZE(ntpServer)-1,     defNtpServer,      0},
+  {26, nameOtaPassword,     helpOtaPassword,     FIELD_STRING, FIELD(otaPassword),        0, FIELD_SIZE(otaPassword)-1,   defEmpty,          FIELD_SECRET|FIELD_UNIT_ONLY},
+  {27, nameOtaValidate,     helpOtaValidate,     FIELD_UINT,   FIELD(otaValidate),        0, 3600,                        defOtaValidate,    0},
+  {28, nameGroupTopic,      helpGroupTopic,      FIELD_STRING, FIELD(mqttGroupTopic),     0, FIELD_SIZE(mqttGroupTopic)-1, defEmpty,         FIELD_UNIT_ONLY},
+  };
+#define SETTING_FIELD_COUNT (sizeof(settingFields)/sizeof(settingFields[0]))
+static_assert(SETTING_FIELD_COUNT<=SETTING_FIELD_MAX,"settingsRecord is too small for the settings table");
+
+uint8_t settingsRecord[SETTINGS_RECORD_SIZE];
+
+/*
+ * Read an entry of the settings table out of flash.
+ */
+void getSettingField(size_t index, settingField* field)
+  {
+  memcpy_P(field,&settingFields[index],sizeof(settingField));
+  }
+
+size_t settingCount()
+  {
+  return SETTING_FIELD_COUNT;
+  }
+
+/*
+ * Print the value of one setting.
+ */
+void printSettingValue(Print& out, const settingField* field, const conf* source)
+  {
+  const void* value=(const uint8_t*)source+field->offset;
+  switch (field->type)
+    {
+    case FIELD_STRING:
+      out.print((const char*)value);
+      break;
+    case FIELD_INT:
+      out.print(*(const int*)value);
+      break;
+    case FIELD_UINT:
+      out.print(*(const unsigned int*)value);
+      break;
+    case FIELD_BOOL:
+      out.print(*(const boolean*)value?"true":"false");
+      break;
+    default:
+      break;
+    }
+  }
+
+/*
+ * Copy a string setting if it fits.
+ */
+boolean setString(char* field, size_t size, const char* val)
+  {
+  if (strlen(val)>=size)
+    {
+    Serial.print(F("Value too long, maximum is "));
+    Serial.println(size-1);
+    return false;
+    }
+  strcpy(field,val);
+  return true;
+  }
+
+/*
+ * Find a setting in the settings table by name and copy its entry into
+ * field.  Returns false if there isn't one.
+ */
+boolean findSetting(const char* nme, settingField* field)
+  {
+  for (size_t i=0;i<SETTING_FIELD_COUNT;i++)
+    {
+    getSettingField(i,field);
+    if (strcmp_P(nme,field->name)==0)
+      return true;
+    }
+  return false;
+  }
+
+/*
+ * Store a value into one field of the given settings struct, checking 
+ * it against the limits in the settings table.
+ */
+boolean storeSetting(conf* target, const settingField* field, const char* val)
+  {
+  void* dest=(uint8_t*)target+field->offset;
+  char* end;
+  switch (field->type)
+    {
+    case FIELD_STRING:
+      return setString((char*)dest,field->maximum+1,val);
+    case FIELD_INT:
+      {
+      long num=strtol(val,&end,10);
+      if (*val==0 || *end!=0 || num<field->minimum || num>field->maximum)
+        return false;
+      *(int*)dest=num;
+      return true;
+      }
+    case FIELD_UINT:
+      {
+      unsigned long num=strtoul(val,&end,10);
+      if (*val==0 || *end!=0 || *val=='-' 
+          || num<(unsigned long)field->minimum || num>(unsigned long)field->maximum)
+        return false;
+      *(unsigned int*)dest=num;
+      return true;
+      }
+    case FIELD_BOOL:
+      *(boolean*)dest=strcmp(val,"false")==0?false:true;
+      return true;
+    default:
+      return false;
+    }
+  }
+
+/*
+ * Store one setting into the given settings struct.  Returns false if the
+ * name isn't a setting or the value doesn't fit.  Nothing is saved here.
+ */
+boolean applySetting(conf* target, const char* nme, const char* val)
+  {
+  if (strcmp(nme,"resetmqttid")==0) //not a setting, but it changes one
+    {
+    if (strcmp(val,"yes")!=0)
+      return false;
+    generateMqttClientId(target->mqttClientId);
+    return true;
+    }
+
+  settingField field;
+  if (!findSetting(nme,&field) || (field.flags & (FIELD_READ_ONLY|FIELD_HIDDEN)))
+    return false;
+  if (!storeSetting(target,&field,val))
+    return false;
+
+  if (field.flags & FIELD_CLEARS_FAST_CACHE)
+    target->fastCache.valid=0; //different network, or starting over
+  return true;
+  }
+
+/*
+ * Strip leading and trailing blanks, CRs and LFs in place.
+ */
+char* trim(char* str)
+  {
+  while (*str==' ' || *str=='\t' || *str=='\r' || *str=='\n')
+    str++;
+  char* end=str+strlen(str);
+  while (end>str && (end[-1]==' ' || end[-1]=='\t' || end[-1]=='\r' || end[-1]=='\n'))
+    *--end=0;
+  return str;
+  }
+
+/*
+ * Returns true if the command holds more than one setting, either as
+ * name=value pairs separated by newlines or semicolons, or as a JSON object.
+ */
+boolean isBatchCommand(const char* cmd)
+  {
+  while (*cmd==' ' || *cmd=='\t')
+    cmd++;
+  if (*cmd=='{')
+    return true;
+  const char* end=cmd+strlen(cmd);
+  while (end>cmd && (end[-1]=='\r' || end[-1]=='\n' || end[-1]==';'))
+    end--; //a trailing separator doesn't make it a batch
+  for (const char* c=cmd;c<end;c++)
+    {
+    if (*c==';' || *c=='\n')
+      return true;
+    }
+  return false;
+  }
+
+/*
+ * True if cmd may be taken from the group topic.  One message there reaches
+ * every unit, so it can only change settings that can't cut them all off:
+ * no batches, no dumps, no resets and nothing marked FIELD_UNIT_ONLY.
+ */
+boolean isGroupCommand(const char* cmd)
+  {
+  if (isBatchCommand(cmd))
+    return false;
+  size_t length=strcspn(cmd,"=\r\n");
+  char nme[24]; //longer than any setting name
+  if (length==0 || length>=sizeof(nme))
+    return false;
+  memcpy(nme,cmd,length);
+  nme[length]=0;
+  settingField field;
+  if (!findSetting(nme,&field))
+    return false; //reset, factorydefaults, settings, profile
+  return !(field.flags & (FIELD_UNIT_ONLY|FIELD_READ_ONLY|FIELD_HIDDEN));
+  }
+
+/*
+ * Parse a flat JSON object of settings and apply each one to target.
+ * Works in place on the buffer.  Returns the number of settings applied,
+ * or -1 if something was wrong, in which case *badName points at the
+ * offending name (or is NULL if the JSON itself was bad).
+ */
+int applyJsonBatch(conf* target, char* p, const char** badName)
+  {
+  int count=0;
+  *badName=NULL;
+  while (*p==' ' || *p=='\t' || *p=='\r' || *p=='\n') p++;
+  if (*p++!='{')
+    return -1;
+  while (true)
+    {
+    while (*p==' ' || *p=='\t' || *p=='\r' || *p=='\n' || *p==',') p++;
+    if (*p=='}')
+      return count;
+    if (*p++!='"')
+      return -1;
+    char* nme=p;
+    while (*p && *p!='"') p++;
+    if (!*p)
+      return -1;
+    *p++=0;
+    while (*p==' ' || *p=='\t') p++;
+    if (*p++!=':')
+      return -1;
+    while (*p==' ' || *p=='\t') p++;
+
+    char* val;
+    if (*p=='"') //string, undo any escapes as we go
+      {
+      val=++p;
+      char* out=p;
+      while (*p && *p!='"')
+        {
+        if (*p=='\\' && p[1])
+          p++;
+        *out++=*p++;
+        }
+      if (!*p)
+        return -1;
+      p++;
+      *out=0;
+      }
+    else //number or true/false
+      {
+      val=p;
+      while (*p && *p!=',' && *p!='}' && *p!=' ' && *p!='\r' && *p!='\n') p++;
+      char next=*p;
+      *p=0;
+      if (next=='}')
+        {
+        if (!applySetting(target,nme,val))
+          {
+          *badName=nme;
+          return -1;
+          }
+        return count+1;
+        }
+      if (next)
+        p++;
+      }
+    if (!applySetting(target,nme,val))
+      {
+      *badName=nme;
+      return -1;
+      }
+    count++;
+    }
+  }
+
+/*
+ * Process one name=value command.  This works in place on the buffer, which
+ * must have room for a terminating null at cmd[length], and doesn't 
+ * allocate anything.
+ */
+bool processCommand(char* cmd, unsigned int length)
+  {
+  //Get rid of the carriage return and/or linefeed.
+  while (length>0 && (cmd[length-1]==13 || cmd[length-1]==10))
+    length--;
+  cmd[length]=0;
+
+  char *nme=cmd;
+  char *val=(char*)memchr(cmd,'=',length);
+  if (val!=NULL)
+    *val++=0; //split the name from the value
+  else
+    val=cmd+length; //no value, use the empty string at the end
+
+  if (settings.debug)
+    {
+    Serial.print(F("Processing command \""));
+    Serial.print(nme);
+    Serial.println('"');
+    Serial.print(F("Length:"));
+    Serial.println(strlen(nme));
+    Serial.print(F("Hex:"));
+    Serial.println(nme[0],HEX);
+    Serial.print(F("Value is \""));
+    Serial.print(val);
+    Serial.println(F("\"\n"));
+    }
+
+  if (*nme==0) //empty string is a valid val value
+    {
+    showSettings();
+    return false;   //not a valid command, or it's missing
+    }
+  else if ((strcmp(nme,"factorydefaults")==0) && (strcmp(val,"yes")==0)) //reset all eeprom settings
+    {
+    Serial.println(F("\n*********************** Resetting EEPROM Values ************************"));
+    initializeSettings();
+    saveSettings();
+    commitSettings();
+    runtimeClear(); //start with a full run
+    delay(2000);
+    ESP.restart();
+    }
+  else if (strcmp(nme,"profile")==0) //show the loop profile and start a new one
+    {
+    profileDump(Serial);
+    profileReset();
+    return true;
+    }
+  else if ((strcmp(nme,"reset")==0) && (strcmp(val,"yes")==0)) //reset the device
+    {
+    Serial.println(F("\n*********************** Resetting Device ************************"));
+    commitSettings(); //don't lose anything that was just changed
+    runtimeClear(); //a deliberate reset gets a full run
+    delay(1000);
+    ESP.restart();
+    }
+  else if (applySetting(&settings,nme,val))
+    {
+    saveSettings();
+    eventLog(EVENT_CONFIG);
+    }
+  else
+    {
+    showSettings();
+    return false; //command not found
+    }
+  return true;
+  }
+
+/*
+ * Set every field to the default from the settings table.
+ */
+void initializeDefaults()
+  {
+  char value[MQTT_MAX_TOPIC_SIZE];
+  settingField field;
+  settings=conf(); //start from the struct defaults for anything without one
+  for (size_t i=0;i<SETTING_FIELD_COUNT;i++)
+    {
+    getSettingField(i,&field);
+    if (field.defaultValue==NULL)
+      continue; //leave it zeroed
+    strncpy_P(value,field.defaultValue,sizeof(value)-1);
+    value[sizeof(value)-1]=0;
+    storeSetting(&settings,&field,value);
+    }
+  }
+
+/*
+ * Returns true if everything needed to connect is filled in.
+ */
+boolean settingsComplete(const conf* s)
+  {
+  settingField field;
+  for (size_t i=0;i<SETTING_FIELD_COUNT;i++)
+    {
+    getSettingField(i,&field);
+    const void* value=(const uint8_t*)s+field.offset;
+    switch (field.type)
+      {
+      case FIELD_STRING:
+        {
+        size_t len=strnlen((const char*)value,field.size);
+        if ((field.flags & FIELD_ADDS_SLASH) && len>0 && ((const char*)value)[len-1]=='/')
+          len--; //saveSettings() put it there
+        if (len<(size_t)field.minimum || len>(size_t)field.maximum)
+          return false;
+        break;
+        }
+      case FIELD_INT:
+        if (*(const int*)value<field.minimum || *(const int*)value>field.maximum)
+          return false;
+        break;
+      case FIELD_UINT:
+        if (*(const unsigned int*)value<(unsigned int)field.minimum 
+            || *(const unsigned int*)value>(unsigned int)field.maximum)
+          return false;
+        break;
+      default:
+        break;
+      }
+    }
+  return true;
+  }
+
+/*
+ * Pack the settings into settingsRecord as a list of (id, length, value)
+ * entries.  Strings are saved without their unused space.  Because each
+ * field is saved under its id the struct can change from one version to
+ * the next without losing anything.  Returns the record length.
+ */
+size_t packSettings(const conf* source)
+  {
+  size_t length=0;
+  settingField field;
+  for (size_t i=0;i<SETTING_FIELD_COUNT;i++)
+    {
+    getSettingField(i,&field);
+    const uint8_t* value=(const uint8_t*)source+field.offset;
+    size_t size=field.type==FIELD_STRING?strnlen((const char*)value,field.size-1):field.size;
+    settingsRecord[length++]=field.id;
+    settingsRecord[length++]=size;
+    memcpy(&settingsRecord[length],value,size);
+    length+=size;
+    }
+  return length;
+  }
+
+/*
+ * Unpack a record made by packSettings().  Fields that aren't in the
+ * record keep whatever value they already have.
+ */
+void unpackSettings(conf* target, size_t length)
+  {
+  size_t pos=0;
+  while (pos+2<=length)
+    {
+    uint8_t id=settingsRecord[pos++];
+    uint8_t size=settingsRecord[pos++];
+    if (pos+size>length)
+      break;
+    const uint8_t* value=&settingsRecord[pos];
+    pos+=size;
+
+    settingField field;
+    size_t i;
+    for (i=0;i<SETTING_FIELD_COUNT;i++)
+      {
+      getSettingField(i,&field);
+      if (field.id==id)
+        break;
+      }
+    if (i==SETTING_FIELD_COUNT)
+      continue; //from a newer version, skip it
+    uint8_t* dest=(uint8_t*)target+field.offset;
+    if (field.type==FIELD_STRING)
+      {
+      size_t count=size<field.size?size:field.size-1;
+      memcpy(dest,value,count);
+      dest[count]=0;
+      }
+    else if (size==field.size)
+      memcpy(dest,value,size);
+    }
+  }
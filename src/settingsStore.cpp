@@ -0,0 +1,342 @@
+/*
+ * Wear-levelled record store.  See settingsStore.h for the big picture.
+ *
+ * Record layout in flash, all 4-byte aligned:
+ *   storeHeader (16 bytes)
+ *   payload (length bytes, padded to a multiple of 4)
+ *
+ * The payload is written first and the header last, so a record that was
+ * cut short by a power failure has a blank header and is never seen. The
+ * blank space after the last record is checked at startup; if anything was
+ * half written there the log moves to a fresh sector on the next write.
+ */
+#include <Arduino.h>
+#include <coredecls.h>
+#include <flash_hal.h>
+
+#include "settingsStore.h"
+
+typedef struct
+  {
+  uint16_t magic;    //STORE_MAGIC
+  uint8_t type;      //STORE_RECORD_xxx
+  uint8_t reserved;
+  uint16_t length;   //payload bytes, not counting padding
+  uint16_t reserved2;
+  uint32_t sequence; //goes up by one on every write
+  uint32_t crc;      //crc32 of the payload, seeded with the header fields above
+  } storeHeader;
+
+typedef struct
+  {
+  uint32_t address;  //flash address of the header, 0 if none
+  uint32_t sequence;
+  uint16_t length;
+  } storeIndex;
+
+#define STORE_WORD(x) (((x)+3)&~3)  //round up to a whole number of 32 bit words
+#define STORE_CHUNK 64               //bytes moved through the stack at a time
+
+static uint32_t storeBase=0;        //flash address of the first sector
+static boolean storeReady=false;
+static int activeSector=0;          //sector currently being appended to
+static uint32_t writeOffset=0;      //next free byte within the active sector
+static uint32_t nextSequence=1;
+static storeIndex latest[STORE_MAX_TYPES]; //newest good record of each type
+
+static uint32_t sectorAddress(int sector)
+  {
+  return storeBase+sector*FLASH_SECTOR_SIZE;
+  }
+
+static uint32_t headerCrc(const storeHeader* header)
+  {
+  uint32_t fields[2];
+  fields[0]=header->magic | (header->type<<16) | (header->reserved<<24);
+  fields[1]=header->length | (header->reserved2<<16);
+  uint32_t crc=crc32(fields,sizeof(fields));
+  return crc32(&header->sequence,sizeof(header->sequence),crc);
+  }
+
+/*
+ * Check the payload of a record against its CRC without reading the
+ * whole thing into RAM.
+ */
+static boolean recordIsGood(uint32_t address, const storeHeader* header)
+  {
+  uint32_t buf[STORE_CHUNK/4];
+  uint32_t crc=headerCrc(header);
+  uint32_t done=0;
+  while (done<header->length)
+    {
+    uint32_t count=header->length-done;
+    if (count>STORE_CHUNK)
+      count=STORE_CHUNK;
+    if (!ESP.flashRead(address+sizeof(storeHeader)+done,buf,STORE_WORD(count)))
+      return false;
+    crc=crc32(buf,count,crc);
+    done+=count;
+    }
+  return crc==header->crc;
+  }
+
+/*
+ * Returns true if the flash from address to the end of its sector is erased.
+ */
+static boolean isBlank(uint32_t address, uint32_t end)
+  {
+  uint32_t buf[STORE_CHUNK/4];
+  while (address<end)
+    {
+    uint32_t count=end-address;
+    if (count>STORE_CHUNK)
+      count=STORE_CHUNK;
+    if (!ESP.flashRead(address,buf,count))
+      return false;
+    for (uint32_t i=0;i<count/4;i++)
+      {
+      if (buf[i]!=0xFFFFFFFF)
+        return false;
+      }
+    address+=count;
+    }
+  return true;
+  }
+
+/*
+ * Walk the records in one sector, updating the index.  Returns the offset
+ * of the first byte after the last good record.
+ */
+static uint32_t scanSector(int sector, uint32_t* highestSequence)
+  {
+  uint32_t base=sectorAddress(sector);
+  uint32_t offset=0;
+  while (offset+sizeof(storeHeader)<=FLASH_SECTOR_SIZE)
+    {
+    storeHeader header;
+    if (!ESP.flashRead(base+offset,(uint32_t*)&header,sizeof(header)))
+      break;
+    if (header.magic!=STORE_MAGIC
+        || header.type==0
+        || header.type>=STORE_MAX_TYPES
+        || offset+sizeof(header)+STORE_WORD(header.length)>FLASH_SECTOR_SIZE)
+      break; //blank space or garbage, either way that's the end
+
+    if (recordIsGood(base+offset,&header))
+      {
+      if (latest[header.type].address==0 || header.sequence>latest[header.type].sequence)
+        {
+        latest[header.type].address=base+offset;
+        latest[header.type].sequence=header.sequence;
+        latest[header.type].length=header.length;
+        }
+      if (header.sequence>*highestSequence)
+        *highestSequence=header.sequence;
+      }
+    offset+=sizeof(header)+STORE_WORD(header.length);
+    }
+  return offset;
+  }
+
+/*
+ * Find the log and build the index of the newest record of each type.
+ * Returns false if there is no room for the log in this flash layout.
+ */
+bool storeBegin()
+  {
+  uint32_t fsStart=(uint32_t)(uintptr_t)&_FS_start-0x40200000;
+  uint32_t fsEnd=(uint32_t)(uintptr_t)&_FS_end-0x40200000;
+  if (fsEnd<=fsStart || fsEnd-fsStart<STORE_SECTORS*FLASH_SECTOR_SIZE)
+    {
+    Serial.println(F("No flash space for the settings log, using EEPROM."));
+    storeReady=false;
+    return false;
+    }
+  storeBase=fsStart;
+  memset(latest,0,sizeof(latest));
+
+  uint32_t highest=0;
+  uint32_t ends[STORE_SECTORS];
+  for (int sector=0;sector<STORE_SECTORS;sector++)
+    {
+    uint32_t before=highest;
+    ends[sector]=scanSector(sector,&highest);
+    if (highest>before)
+      activeSector=sector; //the newest record is in here
+    }
+  nextSequence=highest+1;
+  writeOffset=ends[activeSector];
+
+  //If the last write was interrupted there may be junk after the last good
+  //record.  Don't try to write on top of it.
+  if (!isBlank(sectorAddress(activeSector)+writeOffset,sectorAddress(activeSector)+FLASH_SECTOR_SIZE))
+    writeOffset=FLASH_SECTOR_SIZE;
+
+  storeReady=true;
+  return true;
+  }
+
+/*
+ * Copy the newest record of the given type into data.  Returns the length
+ * of the stored record (which may differ from size), or 0 if there isn't one.
+ */
+size_t storeRead(uint8_t type, void* data, size_t size)
+  {
+  if (!storeReady || type==0 || type>=STORE_MAX_TYPES || latest[type].address==0)
+    return 0;
+  uint32_t buf[STORE_CHUNK/4];
+  uint32_t address=latest[type].address+sizeof(storeHeader);
+  size_t length=latest[type].length;
+  size_t want=length<size?length:size;
+  size_t done=0;
+  while (done<want)
+    {
+    size_t count=want-done;
+    if (count>STORE_CHUNK)
+      count=STORE_CHUNK;
+    if (!ESP.flashRead(address+done,buf,STORE_WORD(count)))
+      return 0;
+    memcpy((uint8_t*)data+done,buf,count);
+    done+=count;
+    }
+  return length;
+  }
+
+/*
+ * Write the payload at the given address in STORE_CHUNK sized pieces
+ * from either RAM or another place in flash.
+ */
+static boolean writePayload(uint32_t address, const void* data, uint32_t fromFlash, size_t length)
+  {
+  uint32_t buf[STORE_CHUNK/4];
+  size_t done=0;
+  while (done<length)
+    {
+    size_t count=length-done;
+    if (count>STORE_CHUNK)
+      count=STORE_CHUNK;
+    memset(buf,0xFF,sizeof(buf));
+    if (fromFlash)
+      {
+      if (!ESP.flashRead(fromFlash+done,buf,STORE_WORD(count)))
+        return false;
+      }
+    else
+      memcpy(buf,(const uint8_t*)data+done,count);
+    if (!ESP.flashWrite(address+done,buf,STORE_WORD(count)))
+      return false;
+    done+=count;
+    }
+  return true;
+  }
+
+/*
+ * Append one record to the active sector.  The caller has made sure that
+ * it fits.
+ */
+static boolean appendRecord(uint8_t type, const void* data, uint32_t fromFlash, size_t length, uint32_t sequence)
+  {
+  uint32_t address=sectorAddress(activeSector)+writeOffset;
+  storeHeader header;
+  header.magic=STORE_MAGIC;
+  header.type=type;
+  header.reserved=0;
+  header.length=length;
+  header.reserved2=0;
+  header.sequence=sequence;
+  if (fromFlash)
+    {
+    //copying forward, the old header already has a good CRC
+    storeHeader old;
+    if (!ESP.flashRead(fromFlash-sizeof(storeHeader),(uint32_t*)&old,sizeof(old)))
+      return false;
+    header.crc=old.crc;
+    }
+  else
+    header.crc=crc32(data,length,headerCrc(&header));
+
+  if (!writePayload(address+sizeof(header),data,fromFlash,length)
+      || !ESP.flashWrite(address,(uint32_t*)&header,sizeof(header)))
+    return false;
+
+  latest[type].address=address;
+  latest[type].sequence=sequence;
+  latest[type].length=length;
+  writeOffset+=sizeof(header)+STORE_WORD(length);
+  return true;
+  }
+
+/*
+ * Returns true if the newest record of any type is in the given sector.
+ */
+static boolean holdsLive(int sector)
+  {
+  uint32_t start=sectorAddress(sector);
+  for (uint8_t type=1;type<STORE_MAX_TYPES;type++)
+    {
+    if (latest[type].address!=0
+        && latest[type].address>=start && latest[type].address<start+FLASH_SECTOR_SIZE)
+      return true;
+    }
+  return false;
+  }
+
+/*
+ * Move the log to the next sector, carrying the newest record of every
+ * type except skipType along with it.
+ *
+ * The copies keep their sequence numbers, so after a power cut part way
+ * through storeBegin() may pick either sector as the active one, and the
+ * newest record of a type may be left behind in an older sector.  That's
+ * fine as long as every compaction copies the newest record of each type
+ * from wherever it is rather than only from the sector it is leaving.
+ */
+static boolean compact(uint8_t skipType)
+  {
+  int oldSector=activeSector;
+  //Several compactions in a row that were cut short can leave live records
+  //in the next sector too.  Don't erase those.
+  do
+    activeSector=(activeSector+1)%STORE_SECTORS;
+  while (activeSector!=oldSector && holdsLive(activeSector));
+  if (activeSector==oldSector)
+    return false;
+  writeOffset=0;
+  if (!ESP.flashEraseSector(sectorAddress(activeSector)/FLASH_SECTOR_SIZE))
+    return false;
+
+  for (uint8_t type=1;type<STORE_MAX_TYPES;type++)
+    {
+    if (type==skipType || latest[type].address==0)
+      continue;
+    storeHeader old;
+    if (!ESP.flashRead(latest[type].address,(uint32_t*)&old,sizeof(old)))
+      return false;
+    if (!appendRecord(type,NULL,latest[type].address+sizeof(storeHeader),old.length,old.sequence))
+      return false;
+    }
+  return true;
+  }
+
+/*
+ * Save a record.  Normally this is just an append; only when the active
+ * sector is full is another sector erased.
+ */
+bool storeWrite(uint8_t type, const void* data, size_t size)
+  {
+  if (!storeReady || type==0 || type>=STORE_MAX_TYPES)
+    return false;
+  size_t needed=sizeof(storeHeader)+STORE_WORD(size);
+  if (needed>FLASH_SECTOR_SIZE/2)
+    return false; //won't fit alongside the other types
+
+  if (writeOffset+needed>FLASH_SECTOR_SIZE)
+    {
+    if (!compact(type))
+      {
+      Serial.println(F("************ Settings log compaction failed!"));
+      return false;
+      }
+    }
+  return appendRecord(type,data,0,size,nextSequence++);
+  }
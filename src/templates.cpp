@@ -0,0 +1,69 @@
+/*
+ * Template substitution.  See templates.h.
+ */
+#include <Arduino.h>
+#include <pgmspace.h>
+
+#include "templates.h"
+
+static inline char templateChar(const char* p, bool progmem)
+  {
+  return progmem?pgm_read_byte(p):*p;
+  }
+
+static void render(Print& out, const char* tpl, bool progmem, templateResolver resolve, const void* context)
+  {
+  char c;
+  while ((c=templateChar(tpl++,progmem))!=0)
+    {
+    if (c!='{')
+      {
+      out.write(c);
+      continue;
+      }
+    char key[TEMPLATE_KEY_SIZE+1];
+    size_t len=0;
+    const char* p=tpl;
+    char k;
+    while ((k=templateChar(p,progmem))!=0 && k!='}' && k!='{' && len<TEMPLATE_KEY_SIZE)
+      {
+      key[len++]=k;
+      p++;
+      }
+    if (k!='}' || len==0)
+      {
+      out.write(c); //not a placeholder
+      continue;
+      }
+    key[len]=0;
+    resolve(out,key,context);
+    tpl=p+1;
+    }
+  }
+
+/*
+ * Render a template in RAM.
+ */
+void renderTemplate(Print& out, const char* tpl, templateResolver resolve, const void* context)
+  {
+  render(out,tpl,false,resolve,context);
+  }
+
+/*
+ * Render a template in flash.
+ */
+void renderTemplate_P(Print& out, PGM_P tpl, templateResolver resolve, const void* context)
+  {
+  render(out,tpl,true,resolve,context);
+  }
+
+/*
+ * Render a template in RAM into buf, which is always null terminated.
+ * Returns the length of the result, which is cut short if buf is too small.
+ */
+size_t renderTemplate(char* buf, size_t size, const char* tpl, templateResolver resolve, const void* context)
+  {
+  bufferPrint out(buf,size);
+  render(out,tpl,false,resolve,context);
+  return out.length();
+  }
@@ -0,0 +1,49 @@
+/*
+ * SNTP wall clock.  See wallClock.h.
+ */
+#include <Arduino.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "wallClock.h"
+
+static bool clockSet=false;
+
+/*
+ * Start SNTP in UTC.  Returns right away.  An empty server name leaves the
+ * clock unset and everything goes out without timestamps.
+ */
+void clockBegin(const char* server)
+  {
+  if (server[0]!='\0')
+    configTime(0,0,server);
+  }
+
+/*
+ * Call from every pass through loop().  Returns true on the pass that first
+ * sees the clock set.
+ */
+bool clockService()
+  {
+  if (clockSet || time(nullptr)<(time_t)CLOCK_VALID_EPOCH)
+    return false;
+  clockSet=true;
+  return true;
+  }
+
+bool clockValid()
+  {
+  return clockSet;
+  }
+
+/*
+ * Milliseconds since the Unix epoch, or 0 if the clock hasn't been set.
+ */
+uint64_t clockNowMs()
+  {
+  if (!clockSet)
+    return 0;
+  struct timeval tv;
+  gettimeofday(&tv,nullptr);
+  return (uint64_t)tv.tv_sec*1000+tv.tv_usec/1000;
+  }
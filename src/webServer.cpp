@@ -0,0 +1,295 @@
+/*
+ * Local status and settings pages.  See webServer.h.
+ */
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESP8266WebServer.h>
+#include <pgmspace.h>
+
+#include "runLimiter.h"
+#include "settings.h"
+#include "limiter.h"
+#include "dutyCycle.h"
+#include "cycleLog.h"
+#include "runtimeRecord.h"
+#include "templates.h"
+#include "webServer.h"
+
+extern conf settings;
+extern channelState channels[CHANNEL_COUNT];
+
+static ESP8266WebServer server(WEB_PORT);
+static bool serverStarted=false;
+
+static const char pageHead[] PROGMEM =
+  "<!DOCTYPE html><html><head><meta name=viewport content=\"width=device-width\">"
+  "<title>{clientId}</title></head><body><h2>Run Limiter {clientId}</h2>";
+
+static const char pageFoot[] PROGMEM = "</body></html>";
+
+static const char statusPage[] PROGMEM =
+  "<table>"
+  "{channels}"
+  "<tr><td>Running for</td><td>{uptime} s</td></tr>"
+  "<tr><td>Duty cycle used</td><td>{duty} s</td></tr>"
+  "<tr><td>Power cycles</td><td>{cycles}</td></tr>"
+  "<tr><td>Warm resets</td><td>{resets}</td></tr>"
+  "<tr><td>Broker</td><td>{broker}</td></tr>"
+  "<tr><td>RSSI</td><td>{rssi} dBm</td></tr>"
+  "<tr><td>IP address</td><td>{ip}</td></tr>"
+  "<tr><td>Free heap</td><td>{heap}</td></tr>"
+  "</table><p><a href=/settings>Settings</a>";
+
+static const char formHead[] PROGMEM =
+  "<p>{message}<form method=POST action=/settings><table>";
+
+static const char formText[] PROGMEM =
+  "<tr><td>{name}</td><td><input type={input} name={name} value=\"{value}\"{readonly}></td><td>{help}</td></tr>";
+
+static const char formBool[] PROGMEM =
+  "<tr><td>{name}</td><td><select name={name}><option{false}>false</option><option{true}>true</option></select></td><td>{help}</td></tr>";
+
+static const char formFoot[] PROGMEM =
+  "</table>{save}</form><p>Passwords are left alone unless a new one is typed in."
+  "<p><a href=/>Status</a>";
+
+// Buffers the page and sends it a chunk at a time
+class chunkPrint: public Print
+  {
+  public:
+    chunkPrint(): _len(0) {}
+    size_t write(uint8_t c) override
+      {
+      _buf[_len++]=c;
+      if (_len==sizeof(_buf))
+        flush();
+      return 1;
+      }
+    void flush() override
+      {
+      if (_len>0)
+        server.sendContent(_buf,_len);
+      _len=0;
+      }
+  private:
+    char _buf[WEB_CHUNK_SIZE];
+    size_t _len;
+  };
+
+// Escapes the characters that mean something in HTML
+class htmlPrint: public Print
+  {
+  public:
+    htmlPrint(Print& out): _out(out) {}
+    size_t write(uint8_t c) override
+      {
+      switch (c)
+        {
+        case '&': return _out.print(F("&amp;"));
+        case '<': return _out.print(F("&lt;"));
+        case '>': return _out.print(F("&gt;"));
+        case '"': return _out.print(F("&quot;"));
+        default:  return _out.write(c);
+        }
+      }
+  private:
+    Print& _out;
+  };
+
+/*
+ * Placeholders that can be used in any page.
+ */
+static void resolveStatus(Print& out, const char* key, const void* context)
+  {
+  htmlPrint html(out);
+  uint64_t now=myMillis();
+  if (strcmp_P(key,PSTR("clientId"))==0)
+    html.print(settings.mqttClientId);
+  else if (strcmp_P(key,PSTR("channels"))==0)
+    {
+    for (int i=0;i<CHANNEL_COUNT;i++)
+      {
+      char number[4]="";
+      if (CHANNEL_COUNT>1)
+        snprintf(number,sizeof(number)," %d",i+1);
+      const limiterState* limiter=&channels[i].limiter;
+      out.printf_P(PSTR("<tr><td>State%s</td><td>%s</td></tr>"),number,limiter->timedOut?"timed out":limiterRunning(limiter)?"running":"idle");
+      out.printf_P(PSTR("<tr><td>Remaining%s</td><td>%lu s</td></tr>"),number,(unsigned long)(limiterRemaining(limiter,now)/1000));
+      }
+    }
+  else if (strcmp_P(key,PSTR("uptime"))==0)
+    out.print((unsigned long)(now/1000));
+  else if (strcmp_P(key,PSTR("duty"))==0)
+    out.print(dutyUsed());
+  else if (strcmp_P(key,PSTR("cycles"))==0)
+    out.print(cycleCount());
+  else if (strcmp_P(key,PSTR("resets"))==0)
+    out.print(runtimeResets());
+  else if (strcmp_P(key,PSTR("broker"))==0)
+    html.print(settings.brokerAddress);
+  else if (strcmp_P(key,PSTR("rssi"))==0)
+    out.print(WiFi.RSSI());
+  else if (strcmp_P(key,PSTR("ip"))==0)
+    out.print(WiFi.localIP());
+  else if (strcmp_P(key,PSTR("heap"))==0)
+    out.print(ESP.getFreeHeap());
+  else if (strcmp_P(key,PSTR("message"))==0 && context!=NULL)
+    html.print((const char*)context);
+  else if (strcmp_P(key,PSTR("save"))==0)
+    {
+    if (adminPassword()!=NULL)
+      out.print(F("<input type=submit value=Save>"));
+    else
+      out.print(F("<p>Read-only, there is no otaPassword or WiFi password to log in with."));
+    }
+  }
+
+/*
+ * Placeholders for one row of the settings form.  context is the field.
+ */
+static void resolveField(Print& out, const char* key, const void* context)
+  {
+  const settingField* field=(const settingField*)context;
+  htmlPrint html(out);
+  bool secret=field->flags & FIELD_SECRET;
+  if (strcmp_P(key,PSTR("name"))==0)
+    out.print(FPSTR(field->name));
+  else if (strcmp_P(key,PSTR("help"))==0)
+    html.print(FPSTR(field->help));
+  else if (strcmp_P(key,PSTR("input"))==0)
+    out.print(secret?F("password"):field->type==FIELD_STRING?F("text"):F("number"));
+  else if (strcmp_P(key,PSTR("value"))==0)
+    {
+    if (!secret)
+      printSettingValue(html,field,&settings);
+    }
+  else if (strcmp_P(key,PSTR("readonly"))==0)
+    {
+    if (field->flags & FIELD_READ_ONLY)
+      out.print(F(" readonly"));
+    }
+  else if (strcmp_P(key,PSTR("true"))==0 || strcmp_P(key,PSTR("false"))==0)
+    {
+    bool value=*((const boolean*)((const uint8_t*)&settings+field->offset));
+    if (value==(strcmp_P(key,PSTR("true"))==0))
+      out.print(F(" selected"));
+    }
+  }
+
+static void beginPage()
+  {
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200,"text/html","");
+  }
+
+static void endPage(chunkPrint& out)
+  {
+  renderTemplate_P(out,pageFoot,resolveStatus,NULL);
+  out.flush();
+  server.sendContent(""); //last chunk
+  }
+
+static void handleStatus()
+  {
+  beginPage();
+  chunkPrint out;
+  renderTemplate_P(out,pageHead,resolveStatus,NULL);
+  renderTemplate_P(out,statusPage,resolveStatus,NULL);
+  endPage(out);
+  }
+
+static void sendForm(const char* message)
+  {
+  beginPage();
+  chunkPrint out;
+  renderTemplate_P(out,pageHead,resolveStatus,NULL);
+  renderTemplate_P(out,formHead,resolveStatus,message);
+  settingField field;
+  for (size_t i=0;i<settingCount();i++)
+    {
+    getSettingField(i,&field);
+    if (field.flags & FIELD_HIDDEN)
+      continue;
+    renderTemplate_P(out,field.type==FIELD_BOOL?formBool:formText,resolveField,&field);
+    }
+  renderTemplate_P(out,formFoot,resolveStatus,NULL);
+  endPage(out);
+  }
+
+static void handleSettings()
+  {
+  sendForm("");
+  }
+
+/*
+ * Apply the submitted form.  Read-only fields and empty passwords are
+ * skipped, and nothing changes unless every field is good.  Refused outright
+ * without an admin password, or anyone on an open network could change it.
+ */
+static void handleSettingsPost()
+  {
+  const char* password=adminPassword();
+  if (password==NULL)
+    {
+    server.send(403,"text/plain","Settings are read-only without an admin password");
+    return;
+    }
+  if (!server.authenticate(WEB_USER,password))
+    {
+    server.requestAuthentication();
+    return;
+    }
+
+  static conf staged; //too big for the stack
+  staged=settings;
+  char message[60];
+  int count=0;
+  settingField field;
+  for (int i=0;i<server.args();i++)
+    {
+    String name=server.argName(i);
+    String value=server.arg(i);
+    if (!findSetting(name.c_str(),&field) || (field.flags & FIELD_READ_ONLY))
+      continue;
+    if ((field.flags & FIELD_SECRET) && value.length()==0)
+      continue;
+    if (!applySetting(&staged,name.c_str(),value.c_str()))
+      {
+      snprintf(message,sizeof(message),"rejected, bad setting \"%s\"",name.c_str());
+      sendForm(message);
+      return;
+      }
+    count++;
+    }
+  commitStaged(&staged,count,message,sizeof(message));
+  sendForm(message);
+  }
+
+static void handleNotFound()
+  {
+  server.send(404,"text/plain","Not found");
+  }
+
+/*
+ * Start the server.  Call once the WiFi is up.
+ */
+void webBegin()
+  {
+  if (serverStarted)
+    return;
+  server.on("/",HTTP_GET,handleStatus);
+  server.on("/settings",HTTP_GET,handleSettings);
+  server.on("/settings",HTTP_POST,handleSettingsPost);
+  server.onNotFound(handleNotFound);
+  server.begin();
+  serverStarted=true;
+  }
+
+/*
+ * Call from loop().
+ */
+void webService()
+  {
+  if (serverStarted)
+    server.handleClient();
+  }
@@ -0,0 +1,104 @@
+/*
+ * Just enough of the Arduino core to build the hardware-free modules
+ * (limiter, templates, settings) on the build machine.  There is no
+ * separate flash address space here, so the PROGMEM helpers are the plain
+ * C library ones.  Everything the firmware sends to Serial is kept in
+ * Serial.output for the tests to look at.
+ */
+#ifndef ARDUINO_STUB_H
+#define ARDUINO_STUB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_ptr(p) (*(const void* const*)(p))
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+#define strncpy_P strncpy
+#define strlen_P strlen
+
+class __FlashStringHelper;
+#define FPSTR(p) (reinterpret_cast<const __FlashStringHelper*>(p))
+#define F(s) FPSTR(s)
+
+#define DEC 10
+#define HEX 16
+
+class Print
+  {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c)=0;
+    virtual size_t write(const uint8_t* buf, size_t size)
+      {
+      size_t n=0;
+      while (size--)
+        n+=write(*buf++);
+      return n;
+      }
+    size_t write(const char* s) {return write((const uint8_t*)s,strlen(s));}
+    size_t write(const char* s, size_t size) {return write((const uint8_t*)s,size);}
+
+    size_t print(const char* s) {return write(s);}
+    size_t print(const __FlashStringHelper* s) {return write((const char*)s);}
+    size_t print(char c) {return write((uint8_t)c);}
+    size_t print(int n, int base=DEC) {return print((long)n,base);}
+    size_t print(unsigned int n, int base=DEC) {return print((unsigned long)n,base);}
+    size_t print(long n, int base=DEC) {return print((long long)n,base);}
+    size_t print(unsigned long n, int base=DEC) {return print((unsigned long long)n,base);}
+    size_t print(long long n, int base=DEC)
+      {
+      if (n<0 && base==DEC)
+        return print('-')+print((unsigned long long)-n,base);
+      return print((unsigned long long)n,base);
+      }
+    size_t print(unsigned long long n, int base=DEC)
+      {
+      char buf[24];
+      snprintf(buf,sizeof(buf),base==HEX?"%llX":"%llu",n);
+      return write(buf);
+      }
+
+    size_t println() {return write("\r\n");}
+    template<typename T> size_t println(T value) {return print(value)+println();}
+    template<typename T> size_t println(T value, int base) {return print(value,base)+println();}
+  };
+
+class HardwareSerial: public Print
+  {
+  public:
+    size_t write(uint8_t c) override
+      {
+      output+=(char)c;
+      return 1;
+      }
+    using Print::write;
+    std::string output;
+  };
+
+inline HardwareSerial Serial;
+
+class EspClass
+  {
+  public:
+    void restart() {restarts++;} //returns, unlike the real one
+    uint32_t getChipId() {return 0x123456;}
+    int restarts=0;
+  };
+
+inline EspClass ESP;
+
+inline void delay(unsigned long ms) {}
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * The parts of main.cpp (and the modules behind it) that settings.cpp
+ * calls, counting the calls instead of doing anything.  Include it from
+ * one file in each test, they are all linked with settings.cpp.
+ */
+#ifndef FIRMWARE_STUB_H
+#define FIRMWARE_STUB_H
+
+#include <string.h>
+#include "settings.h"
+#include "eventQueue.h"
+
+conf settings;
+
+struct
+  {
+  int shown;        //showSettings()
+  int initialized;  //initializeSettings()
+  int saved;        //saveSettings()
+  int committed;    //commitSettings()
+  int cleared;      //runtimeClear()
+  int events;       //eventLog()
+  int profiles;     //profileDump()
+  } firmwareStub;
+
+inline void firmwareStubReset()
+  {
+  memset(&firmwareStub,0,sizeof(firmwareStub));
+  settings=conf();
+  Serial.output.clear();
+  ESP.restarts=0;
+  }
+
+void showSettings() {firmwareStub.shown++;}
+void initializeSettings() {firmwareStub.initialized++;}
+bool saveSettings() {firmwareStub.saved++; return true;}
+bool commitSettings() {firmwareStub.committed++; return true;}
+void runtimeClear() {firmwareStub.cleared++;}
+void eventLog(uint8_t type) {firmwareStub.events++;}
+void profileDump(Print& out) {firmwareStub.profiles++;}
+void profileReset() {}
+
+char* generateMqttClientId(char* mqttId)
+  {
+  strcpy(mqttId,"RunTimeLimiter1234560001");
+  return mqttId;
+  }
+
+#endif
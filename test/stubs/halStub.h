@@ -0,0 +1,76 @@
+/*
+ * The hal.h services for the tests, on top of nothing.  The relays, LEDs
+ * and the broker are just fields in halStub that a test sets up and
+ * checks.  Every test is linked with limiter.cpp, so include it from one
+ * file in each.
+ */
+#ifndef HAL_STUB_H
+#define HAL_STUB_H
+
+#include <string.h>
+#include "hal.h"
+
+#define HAL_STUB_CHANNELS 3
+#define HAL_STUB_MESSAGE_SIZE 200
+
+struct
+  {
+  bool relay[HAL_STUB_CHANNELS];
+  bool led[HAL_STUB_CHANNELS];
+  bool connected;        //the broker connection is up
+  bool held;             //reports are being held back after connecting
+  uint16_t lastPacket;   //ID of the last halPublishReliable() message, 0 for none
+  uint16_t acked;        //the broker has acknowledged everything up to this ID
+  int published;         //messages taken by either publish call
+  char topic[HAL_STUB_MESSAGE_SIZE];   //of the last one
+  char payload[HAL_STUB_MESSAGE_SIZE];
+  } halStub;
+
+inline void halStubReset()
+  {
+  memset(&halStub,0,sizeof(halStub));
+  }
+
+void halSetRelay(uint8_t channel, bool on)
+  {
+  halStub.relay[channel]=on;
+  }
+
+void halSetLed(uint8_t channel, bool on)
+  {
+  halStub.led[channel]=on;
+  }
+
+bool halConnected()
+  {
+  return halStub.connected;
+  }
+
+bool halCanPublish()
+  {
+  return halStub.connected && !halStub.held;
+  }
+
+bool halPublish(const char* topic, const char* payload, bool retain)
+  {
+  if (!halStub.connected)
+    return false;
+  strncpy(halStub.topic,topic,sizeof(halStub.topic)-1);
+  strncpy(halStub.payload,payload,sizeof(halStub.payload)-1);
+  halStub.published++;
+  return true;
+  }
+
+uint16_t halPublishReliable(const char* topic, const char* payload)
+  {
+  if (!halPublish(topic,payload,true))
+    return 0;
+  return ++halStub.lastPacket;
+  }
+
+bool halDelivered(uint16_t id)
+  {
+  return id<=halStub.acked;
+  }
+
+#endif
@@ -0,0 +1,4 @@
+/*
+ * See Arduino.h in this directory, the PROGMEM helpers are there.
+ */
+#include "Arduino.h"
@@ -0,0 +1,135 @@
+/*
+ * Micro-benchmarks for the hot paths: the limiter pass loop() makes every
+ * time round, rendering a status message, the command parser and the
+ * settings record.  The numbers are printed for comparing one build with
+ * the next, the tests only fail if the results are wrong, never because
+ * the build machine is slow.
+ */
+#include <unity.h>
+#include <chrono>
+#include <stdio.h>
+
+#include "limiter.h"
+#include "templates.h"
+#include "settings.h"
+#include "halStub.h"
+#include "firmwareStub.h"
+
+#define BENCH_ITERATIONS 100000
+
+static volatile size_t sink; //so the optimizer can't drop the work
+
+typedef std::chrono::steady_clock benchClock;
+
+// Print the time per call since start.
+static void report(const char* name, benchClock::time_point start, long iterations)
+  {
+  double ns=std::chrono::duration<double,std::nano>(benchClock::now()-start).count()/iterations;
+  char line[80];
+  snprintf(line,sizeof(line),"%-22s %9.1f ns/call",name,ns);
+  TEST_MESSAGE(line);
+  }
+
+void setUp()
+  {
+  halStubReset();
+  firmwareStubReset();
+  initializeDefaults();
+  }
+
+void tearDown()
+  {
+  }
+
+void test_bench_limiter_idle_pass()
+  {
+  limiterState state=limiterState();
+  limiterMessages messages={"root/status","started","timeout",true,NULL,NULL};
+  halStub.connected=true;
+  limiterStart(&state,(uint64_t)BENCH_ITERATIONS*10);
+  limiterService(&state,0,false,&messages); //get the run message out of the way
+
+  bool timedOut=false;
+  benchClock::time_point start=benchClock::now();
+  for (long i=1;i<=BENCH_ITERATIONS;i++)
+    timedOut|=limiterService(&state,i,false,&messages);
+  report("limiterService idle",start,BENCH_ITERATIONS);
+  TEST_ASSERT_FALSE(timedOut);
+  TEST_ASSERT_EQUAL(1,halStub.published);
+  }
+
+static void benchResolver(Print& out, const char* key, const void* context)
+  {
+  if (strcmp(key,"id")==0)
+    out.print("RunTimeLimiter1234560001");
+  else if (strcmp(key,"runtime")==0)
+    out.print(300);
+  else if (strcmp(key,"uptime")==0)
+    out.print(86400UL);
+  }
+
+void test_bench_render_status_message()
+  {
+  char buf[80];
+  benchClock::time_point start=benchClock::now();
+  for (long i=0;i<BENCH_ITERATIONS;i++)
+    sink=renderTemplate(buf,sizeof(buf),"{id} timeout after {runtime}s, up {uptime}s",benchResolver,NULL);
+  report("renderTemplate",start,BENCH_ITERATIONS);
+  TEST_ASSERT_EQUAL_STRING("RunTimeLimiter1234560001 timeout after 300s, up 86400s",buf);
+  }
+
+void test_bench_apply_setting()
+  {
+  conf target=settings;
+  benchClock::time_point start=benchClock::now();
+  for (long i=0;i<BENCH_ITERATIONS;i++)
+    sink=applySetting(&target,"telemetryInterval","60"); //a search down the table
+  report("applySetting",start,BENCH_ITERATIONS);
+  TEST_ASSERT_EQUAL(60,target.telemetryInterval);
+  }
+
+void test_bench_json_batch()
+  {
+  static const char batch[]="{\"ssid\":\"home\",\"wifipass\":\"secret\",\"broker\":\"10.0.0.2\",\"maxRuntime\":600,\"debug\":false}";
+  char buf[sizeof(batch)];
+  conf target=settings;
+  const char* badName;
+  int applied=0;
+  benchClock::time_point start=benchClock::now();
+  for (long i=0;i<BENCH_ITERATIONS/10;i++)
+    {
+    memcpy(buf,batch,sizeof(batch)); //it works in place
+    applied=applyJsonBatch(&target,buf,&badName);
+    }
+  report("applyJsonBatch",start,BENCH_ITERATIONS/10);
+  TEST_ASSERT_EQUAL(5,applied);
+  TEST_ASSERT_EQUAL(600,target.maxRuntime);
+  }
+
+void test_bench_pack_unpack()
+  {
+  applySetting(&settings,"ssid","home");
+  applySetting(&settings,"broker","10.0.0.2");
+  conf copy;
+  size_t length=0;
+  benchClock::time_point start=benchClock::now();
+  for (long i=0;i<BENCH_ITERATIONS/10;i++)
+    {
+    length=packSettings(&settings);
+    unpackSettings(&copy,length);
+    }
+  report("pack+unpackSettings",start,BENCH_ITERATIONS/10);
+  TEST_ASSERT_EQUAL_STRING("10.0.0.2",copy.brokerAddress);
+  TEST_ASSERT_EQUAL_STRING(DEFAULT_MQTT_TOPIC_ROOT,copy.mqttTopicRoot);
+  }
+
+int main(int argc, char** argv)
+  {
+  UNITY_BEGIN();
+  RUN_TEST(test_bench_limiter_idle_pass);
+  RUN_TEST(test_bench_render_status_message);
+  RUN_TEST(test_bench_apply_setting);
+  RUN_TEST(test_bench_json_batch);
+  RUN_TEST(test_bench_pack_unpack);
+  return UNITY_END();
+  }
@@ -0,0 +1,184 @@
+/*
+ * The runtime limiter state machine against the stub HAL.
+ */
+#include <unity.h>
+
+#include "limiter.h"
+#include "halStub.h"
+#include "firmwareStub.h"
+
+static limiterState state;
+static limiterMessages messages;
+
+void setUp()
+  {
+  halStubReset();
+  state=limiterState();
+  state.channel=1;
+  messages={"root/status2","started","timeout",true,NULL,NULL};
+  halStub.relay[1]=true; //on from power-up, as setup() leaves it
+  }
+
+void tearDown()
+  {
+  }
+
+void test_start_counts_down()
+  {
+  limiterStart(&state,5000);
+  TEST_ASSERT_TRUE(limiterRunning(&state));
+  TEST_ASSERT_EQUAL_UINT64(5000,limiterRemaining(&state,0));
+  TEST_ASSERT_EQUAL_UINT64(1500,limiterRemaining(&state,3500));
+  TEST_ASSERT_EQUAL_UINT64(0,limiterRemaining(&state,5000));
+  TEST_ASSERT_EQUAL_UINT64(0,limiterRemaining(&state,9000));
+  }
+
+void test_no_run_has_nothing_remaining()
+  {
+  limiterStop(&state);
+  TEST_ASSERT_FALSE(limiterRunning(&state));
+  TEST_ASSERT_EQUAL_UINT64(0,limiterRemaining(&state,0));
+  }
+
+void test_run_message_waits_for_the_broker()
+  {
+  limiterStart(&state,5000);
+  limiterService(&state,100,false,&messages);
+  TEST_ASSERT_EQUAL(0,halStub.published);
+  TEST_ASSERT_TRUE(state.runMessagePending);
+
+  halStub.connected=true;
+  limiterService(&state,200,false,&messages);
+  TEST_ASSERT_EQUAL(1,halStub.published);
+  TEST_ASSERT_EQUAL_STRING("root/status2",halStub.topic);
+  TEST_ASSERT_EQUAL_STRING("started",halStub.payload);
+  TEST_ASSERT_FALSE(state.runMessagePending);
+
+  limiterService(&state,300,false,&messages);
+  TEST_ASSERT_EQUAL(1,halStub.published); //only once
+  }
+
+void test_status_messages_ignore_the_publish_hold()
+  {
+  halStub.connected=true;
+  halStub.held=true;
+  limiterStart(&state,1000);
+  limiterService(&state,0,false,&messages);
+  TEST_ASSERT_EQUAL_STRING("started",halStub.payload);
+  limiterService(&state,1000,false,&messages);
+  TEST_ASSERT_EQUAL_STRING("timeout",halStub.payload);
+  }
+
+void test_deadline_turns_the_relay_off_once()
+  {
+  halStub.connected=true;
+  limiterStart(&state,5000);
+  TEST_ASSERT_FALSE(limiterService(&state,4999,false,&messages));
+  TEST_ASSERT_TRUE(halStub.relay[1]);
+  TEST_ASSERT_FALSE(halStub.led[1]);
+
+  TEST_ASSERT_TRUE(limiterService(&state,5000,false,&messages));
+  TEST_ASSERT_TRUE(state.timedOut);
+  TEST_ASSERT_FALSE(limiterRunning(&state));
+  TEST_ASSERT_FALSE(halStub.relay[1]);
+  TEST_ASSERT_TRUE(halStub.led[1]);
+  TEST_ASSERT_FALSE(halStub.relay[0]); //other channels untouched
+  TEST_ASSERT_FALSE(halStub.led[0]);
+  TEST_ASSERT_EQUAL_UINT64(0,limiterRemaining(&state,4000)); //stays timed out
+
+  TEST_ASSERT_FALSE(limiterService(&state,5001,false,&messages)); //true only on the first pass
+  }
+
+void test_cutoff_timer_ends_the_run_early()
+  {
+  limiterStart(&state,5000);
+  TEST_ASSERT_TRUE(limiterService(&state,4990,true,&messages));
+  TEST_ASSERT_TRUE(state.timedOut);
+  TEST_ASSERT_FALSE(halStub.relay[1]);
+  TEST_ASSERT_EQUAL_UINT64(0,limiterRemaining(&state,4990));
+  }
+
+void test_timeout_message_waits_for_the_puback()
+  {
+  halStub.connected=true;
+  limiterStart(&state,1000);
+  limiterService(&state,0,false,&messages);
+  limiterService(&state,1000,false,&messages);
+  TEST_ASSERT_EQUAL_STRING("timeout",halStub.payload);
+  TEST_ASSERT_EQUAL_UINT16(2,state.timeoutPacket);
+  TEST_ASSERT_FALSE(state.timeoutMessageSent);
+
+  limiterService(&state,1100,false,&messages);
+  TEST_ASSERT_FALSE(state.timeoutMessageSent);
+  TEST_ASSERT_EQUAL(2,halStub.published); //the QoS 1 layer does the resending, not the limiter
+
+  halStub.acked=2;
+  limiterService(&state,1200,false,&messages);
+  TEST_ASSERT_TRUE(state.timeoutMessageSent);
+  }
+
+void test_timeout_message_follows_a_late_run_message()
+  {
+  limiterStart(&state,1000);
+  limiterService(&state,2000,false,&messages); //timed out before the broker came up
+  TEST_ASSERT_EQUAL(0,halStub.published);
+  TEST_ASSERT_FALSE(halStub.relay[1]);
+
+  halStub.connected=true;
+  limiterService(&state,3000,false,&messages);
+  TEST_ASSERT_EQUAL(2,halStub.published);
+  TEST_ASSERT_EQUAL_STRING("timeout",halStub.payload);
+  }
+
+void test_no_timeout_message_without_notify()
+  {
+  halStub.connected=true;
+  messages.notify=false;
+  limiterStart(&state,1000);
+  limiterService(&state,0,false,&messages);
+  limiterService(&state,1000,false,&messages);
+  TEST_ASSERT_EQUAL(1,halStub.published); //just the run message
+  TEST_ASSERT_EQUAL_UINT16(0,state.timeoutPacket);
+  TEST_ASSERT_FALSE(halStub.relay[1]); //the relay still goes off
+  }
+
+void test_stopped_run_never_times_out()
+  {
+  limiterStart(&state,1000);
+  limiterStop(&state);
+  TEST_ASSERT_FALSE(limiterService(&state,5000,false,&messages));
+  TEST_ASSERT_FALSE(state.timedOut);
+  TEST_ASSERT_TRUE(halStub.relay[1]);
+  }
+
+static size_t testRender(char* buf, size_t size, const char* message, const void* context)
+  {
+  return snprintf(buf,size,"%s %s",(const char*)context,message);
+  }
+
+void test_messages_go_through_the_renderer()
+  {
+  halStub.connected=true;
+  messages.render=testRender;
+  messages.context="pump";
+  limiterStart(&state,1000);
+  limiterService(&state,0,false,&messages);
+  TEST_ASSERT_EQUAL_STRING("pump started",halStub.payload);
+  }
+
+int main(int argc, char** argv)
+  {
+  UNITY_BEGIN();
+  RUN_TEST(test_start_counts_down);
+  RUN_TEST(test_no_run_has_nothing_remaining);
+  RUN_TEST(test_run_message_waits_for_the_broker);
+  RUN_TEST(test_status_messages_ignore_the_publish_hold);
+  RUN_TEST(test_deadline_turns_the_relay_off_once);
+  RUN_TEST(test_cutoff_timer_ends_the_run_early);
+  RUN_TEST(test_timeout_message_waits_for_the_puback);
+  RUN_TEST(test_timeout_message_follows_a_late_run_message);
+  RUN_TEST(test_no_timeout_message_without_notify);
+  RUN_TEST(test_stopped_run_never_times_out);
+  RUN_TEST(test_messages_go_through_the_renderer);
+  return UNITY_END();
+  }
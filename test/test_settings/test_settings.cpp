@@ -0,0 +1,326 @@
+/*
+ * Commands, batches, validation and the packed flash record, all driven
+ * from the settings table.
+ */
+#include <unity.h>
+
+#include "settings.h"
+#include "halStub.h"
+#include "firmwareStub.h"
+
+static conf target;
+static char cmd[COMMAND_LINE_SIZE+1];
+
+void setUp()
+  {
+  firmwareStubReset();
+  initializeDefaults();
+  target=settings;
+  }
+
+void tearDown()
+  {
+  }
+
+// processCommand() works in place and needs room for the terminator.
+static bool command(const char* text)
+  {
+  strcpy(cmd,text);
+  return processCommand(cmd,strlen(cmd));
+  }
+
+void test_defaults_come_from_the_table()
+  {
+  TEST_ASSERT_EQUAL(DEFAULT_MQTT_BROKER_PORT,settings.brokerPort);
+  TEST_ASSERT_EQUAL(DEFAULT_MAX_RUNTIME_SECONDS,settings.maxRuntime);
+  TEST_ASSERT_EQUAL_STRING(DEFAULT_MQTT_TOPIC_ROOT,settings.mqttTopicRoot);
+  TEST_ASSERT_EQUAL_STRING(DEFAULT_MQTT_RUN_MESSAGE,settings.mqttRunMessage);
+  TEST_ASSERT_EQUAL_STRING("",settings.ssid);
+  TEST_ASSERT_FALSE(settings.debug);
+  }
+
+void test_apply_each_field_type()
+  {
+  TEST_ASSERT_TRUE(applySetting(&target,"broker","10.0.0.2"));
+  TEST_ASSERT_EQUAL_STRING("10.0.0.2",target.brokerAddress);
+  TEST_ASSERT_TRUE(applySetting(&target,"brokerPort","8883"));
+  TEST_ASSERT_EQUAL(8883,target.brokerPort);
+  TEST_ASSERT_TRUE(applySetting(&target,"maxRuntime","4000000"));
+  TEST_ASSERT_EQUAL(4000000,target.maxRuntime);
+  TEST_ASSERT_TRUE(applySetting(&target,"debug","true"));
+  TEST_ASSERT_TRUE(target.debug);
+  TEST_ASSERT_TRUE(applySetting(&target,"debug","false"));
+  TEST_ASSERT_FALSE(target.debug);
+  }
+
+void test_out_of_range_values_are_refused()
+  {
+  TEST_ASSERT_FALSE(applySetting(&target,"brokerPort","0"));
+  TEST_ASSERT_FALSE(applySetting(&target,"brokerPort","65535"));
+  TEST_ASSERT_FALSE(applySetting(&target,"brokerPort","12ab"));
+  TEST_ASSERT_FALSE(applySetting(&target,"brokerPort",""));
+  TEST_ASSERT_FALSE(applySetting(&target,"maxRuntime","0"));
+  TEST_ASSERT_FALSE(applySetting(&target,"maxRuntime","4000001"));
+  TEST_ASSERT_FALSE(applySetting(&target,"maxRuntime","-1"));
+  TEST_ASSERT_EQUAL(DEFAULT_MQTT_BROKER_PORT,target.brokerPort); //left alone
+  TEST_ASSERT_EQUAL(DEFAULT_MAX_RUNTIME_SECONDS,target.maxRuntime);
+
+  char tooLong[ADDRESS_SIZE+1];
+  memset(tooLong,'a',ADDRESS_SIZE);
+  tooLong[ADDRESS_SIZE]=0;
+  TEST_ASSERT_FALSE(applySetting(&target,"broker",tooLong));
+  tooLong[ADDRESS_SIZE-1]=0;
+  TEST_ASSERT_TRUE(applySetting(&target,"broker",tooLong));
+  }
+
+void test_unknown_read_only_and_hidden_names_are_refused()
+  {
+  TEST_ASSERT_FALSE(applySetting(&target,"nosuchthing","1"));
+  TEST_ASSERT_FALSE(applySetting(&target,"clientId","mine"));
+  TEST_ASSERT_FALSE(applySetting(&target,"fastCache","1"));
+  TEST_ASSERT_FALSE(applySetting(&target,"maxruntime","10")); //names are case sensitive
+  }
+
+void test_network_changes_clear_the_fast_cache()
+  {
+  target.fastCache.valid=VALID_FAST_CONNECT_FLAG;
+  TEST_ASSERT_TRUE(applySetting(&target,"maxRuntime","10"));
+  TEST_ASSERT_EQUAL(VALID_FAST_CONNECT_FLAG,target.fastCache.valid);
+  TEST_ASSERT_TRUE(applySetting(&target,"ssid","other"));
+  TEST_ASSERT_EQUAL(0,target.fastCache.valid);
+  }
+
+void test_reset_mqtt_id()
+  {
+  TEST_ASSERT_FALSE(applySetting(&target,"resetmqttid","no"));
+  TEST_ASSERT_EQUAL_STRING("",target.mqttClientId);
+  TEST_ASSERT_TRUE(applySetting(&target,"resetmqttid","yes"));
+  TEST_ASSERT_EQUAL_STRING("RunTimeLimiter1234560001",target.mqttClientId);
+  }
+
+void test_command_sets_and_saves()
+  {
+  TEST_ASSERT_TRUE(command("maxRuntime=42\r\n"));
+  TEST_ASSERT_EQUAL(42,settings.maxRuntime);
+  TEST_ASSERT_EQUAL(1,firmwareStub.saved);
+  TEST_ASSERT_EQUAL(1,firmwareStub.events);
+  TEST_ASSERT_EQUAL(0,firmwareStub.shown);
+  }
+
+void test_bad_command_shows_the_settings()
+  {
+  TEST_ASSERT_FALSE(command("nosuchthing=1\n"));
+  TEST_ASSERT_EQUAL(1,firmwareStub.shown);
+  TEST_ASSERT_EQUAL(0,firmwareStub.saved);
+  TEST_ASSERT_FALSE(command("\r\n"));
+  TEST_ASSERT_EQUAL(2,firmwareStub.shown);
+  TEST_ASSERT_FALSE(command("maxRuntime=lots"));
+  TEST_ASSERT_EQUAL(3,firmwareStub.shown);
+  TEST_ASSERT_EQUAL(DEFAULT_MAX_RUNTIME_SECONDS,settings.maxRuntime);
+  }
+
+void test_value_may_be_empty_or_hold_an_equals_sign()
+  {
+  TEST_ASSERT_TRUE(command("userName="));
+  TEST_ASSERT_EQUAL_STRING("",settings.mqttUsername);
+  TEST_ASSERT_TRUE(command("userPass=a=b"));
+  TEST_ASSERT_EQUAL_STRING("a=b",settings.mqttUserPassword);
+  }
+
+void test_reset_commands()
+  {
+  TEST_ASSERT_TRUE(command("reset=yes"));
+  TEST_ASSERT_EQUAL(1,firmwareStub.committed);
+  TEST_ASSERT_EQUAL(1,firmwareStub.cleared);
+  TEST_ASSERT_EQUAL(1,ESP.restarts);
+  TEST_ASSERT_EQUAL(0,firmwareStub.initialized);
+
+  TEST_ASSERT_TRUE(command("factorydefaults=yes"));
+  TEST_ASSERT_EQUAL(1,firmwareStub.initialized);
+  TEST_ASSERT_EQUAL(1,firmwareStub.saved);
+  TEST_ASSERT_EQUAL(2,firmwareStub.committed);
+  TEST_ASSERT_EQUAL(2,ESP.restarts);
+
+  TEST_ASSERT_FALSE(command("reset=no"));
+  TEST_ASSERT_EQUAL(2,ESP.restarts);
+  }
+
+void test_profile_command()
+  {
+  TEST_ASSERT_TRUE(command("profile"));
+  TEST_ASSERT_EQUAL(1,firmwareStub.profiles);
+  }
+
+void test_batch_detection()
+  {
+  TEST_ASSERT_TRUE(isBatchCommand("  {\"debug\":true}"));
+  TEST_ASSERT_TRUE(isBatchCommand("ssid=a;broker=b"));
+  TEST_ASSERT_TRUE(isBatchCommand("ssid=a\nbroker=b"));
+  TEST_ASSERT_FALSE(isBatchCommand("ssid=a"));
+  TEST_ASSERT_FALSE(isBatchCommand("ssid=a;\r\n"));
+  }
+
+void test_group_commands()
+  {
+  TEST_ASSERT_TRUE(isGroupCommand("maxRuntime=600"));
+  TEST_ASSERT_TRUE(isGroupCommand("debug=true\r\n"));
+  TEST_ASSERT_FALSE(isGroupCommand("reset=yes"));
+  TEST_ASSERT_FALSE(isGroupCommand("factorydefaults=yes"));
+  TEST_ASSERT_FALSE(isGroupCommand("settings"));
+  TEST_ASSERT_FALSE(isGroupCommand("profile"));
+  TEST_ASSERT_FALSE(isGroupCommand("ssid=elsewhere"));
+  TEST_ASSERT_FALSE(isGroupCommand("groupTopic="));
+  TEST_ASSERT_FALSE(isGroupCommand("clientId=x"));
+  TEST_ASSERT_FALSE(isGroupCommand("debug=true;maxRuntime=600"));
+  TEST_ASSERT_FALSE(isGroupCommand(""));
+  }
+
+void test_trim()
+  {
+  char text[]=" \t value \r\n";
+  TEST_ASSERT_EQUAL_STRING("value",trim(text));
+  char blank[]=" \r\n";
+  TEST_ASSERT_EQUAL_STRING("",trim(blank));
+  }
+
+void test_json_batch()
+  {
+  char json[]="{\"ssid\": \"home \\\"net\\\"\", \"brokerPort\": 1884,\n \"debug\":true, \"maxRuntime\":60}";
+  const char* badName;
+  TEST_ASSERT_EQUAL(4,applyJsonBatch(&target,json,&badName));
+  TEST_ASSERT_EQUAL_STRING("home \"net\"",target.ssid);
+  TEST_ASSERT_EQUAL(1884,target.brokerPort);
+  TEST_ASSERT_TRUE(target.debug);
+  TEST_ASSERT_EQUAL(60,target.maxRuntime);
+  TEST_ASSERT_NULL(badName);
+  }
+
+void test_json_batch_errors()
+  {
+  const char* badName;
+  char empty[]=" { }";
+  TEST_ASSERT_EQUAL(0,applyJsonBatch(&target,empty,&badName));
+
+  char bad[]="{\"ssid\":\"x\",\"nosuchthing\":1,\"broker\":\"y\"}";
+  TEST_ASSERT_EQUAL(-1,applyJsonBatch(&target,bad,&badName));
+  TEST_ASSERT_EQUAL_STRING("nosuchthing",badName);
+  TEST_ASSERT_EQUAL_STRING("x",target.ssid); //whatever came before is applied
+  TEST_ASSERT_EQUAL_STRING("",target.brokerAddress);
+
+  char badLast[]="{\"maxRuntime\":0}";
+  TEST_ASSERT_EQUAL(-1,applyJsonBatch(&target,badLast,&badName));
+  TEST_ASSERT_EQUAL_STRING("maxRuntime",badName);
+
+  char unterminated[]="{\"ssid\":\"x";
+  TEST_ASSERT_EQUAL(-1,applyJsonBatch(&target,unterminated,&badName));
+  TEST_ASSERT_NULL(badName);
+  char noColon[]="{\"ssid\" \"x\"}";
+  TEST_ASSERT_EQUAL(-1,applyJsonBatch(&target,noColon,&badName));
+  TEST_ASSERT_NULL(badName);
+  char notObject[]="ssid=x";
+  TEST_ASSERT_EQUAL(-1,applyJsonBatch(&target,notObject,&badName));
+  TEST_ASSERT_NULL(badName);
+  }
+
+void test_settings_complete()
+  {
+  TEST_ASSERT_FALSE(settingsComplete(&target)); //no network yet
+  applySetting(&target,"ssid","home");
+  applySetting(&target,"wifipass","secret");
+  TEST_ASSERT_FALSE(settingsComplete(&target));
+  applySetting(&target,"broker","10.0.0.2");
+  TEST_ASSERT_TRUE(settingsComplete(&target));
+
+  char root[MQTT_MAX_TOPIC_SIZE];
+  memset(root,'r',MQTT_MAX_TOPIC_SIZE-2);
+  root[MQTT_MAX_TOPIC_SIZE-2]=0;
+  TEST_ASSERT_TRUE(applySetting(&target,"topicRoot",root));
+  strcat(target.mqttTopicRoot,"/"); //as saveSettings() leaves it
+  TEST_ASSERT_TRUE(settingsComplete(&target));
+
+  target.maxRuntime=0;
+  TEST_ASSERT_FALSE(settingsComplete(&target));
+  }
+
+void test_pack_and_unpack()
+  {
+  applySetting(&target,"ssid","home");
+  applySetting(&target,"brokerPort","1884");
+  applySetting(&target,"debug","true");
+  target.fastCache.valid=VALID_FAST_CONNECT_FLAG;
+  target.fastCache.ip=0x0200000a;
+  size_t length=packSettings(&target);
+  TEST_ASSERT_LESS_THAN(sizeof(conf),length); //the strings are squeezed up
+
+  conf copy;
+  unpackSettings(&copy,length);
+  TEST_ASSERT_EQUAL_STRING("home",copy.ssid);
+  TEST_ASSERT_EQUAL(1884,copy.brokerPort);
+  TEST_ASSERT_TRUE(copy.debug);
+  TEST_ASSERT_EQUAL_STRING(DEFAULT_MQTT_TOPIC_ROOT,copy.mqttTopicRoot);
+  TEST_ASSERT_EQUAL(VALID_FAST_CONNECT_FLAG,copy.fastCache.valid);
+  TEST_ASSERT_EQUAL(0x0200000a,copy.fastCache.ip);
+  }
+
+void test_full_length_strings_survive_packing()
+  {
+  memset(target.ssid,'s',SSID_SIZE-1);
+  target.ssid[SSID_SIZE-1]=0;
+  conf copy;
+  unpackSettings(&copy,packSettings(&target));
+  TEST_ASSERT_EQUAL_STRING(target.ssid,copy.ssid);
+  }
+
+void test_unpack_skips_what_it_does_not_know()
+  {
+  const uint8_t record[]=
+    {
+    200,3,'x','y','z',      //an id from a newer version
+    4,2,0x11,0x22,          //brokerPort, but the wrong size
+    1,4,'h','o','m','e',    //ssid
+    };
+  memcpy(settingsRecord,record,sizeof(record));
+  unpackSettings(&target,sizeof(record));
+  TEST_ASSERT_EQUAL_STRING("home",target.ssid);
+  TEST_ASSERT_EQUAL(DEFAULT_MQTT_BROKER_PORT,target.brokerPort);
+  }
+
+void test_unpack_stops_at_a_truncated_record()
+  {
+  const uint8_t record[]=
+    {
+    1,4,'h','o','m','e',    //ssid
+    3,8,'1','0','.',        //broker, cut short
+    };
+  memcpy(settingsRecord,record,sizeof(record));
+  unpackSettings(&target,sizeof(record));
+  TEST_ASSERT_EQUAL_STRING("home",target.ssid);
+  TEST_ASSERT_EQUAL_STRING("",target.brokerAddress);
+  }
+
+int main(int argc, char** argv)
+  {
+  UNITY_BEGIN();
+  RUN_TEST(test_defaults_come_from_the_table);
+  RUN_TEST(test_apply_each_field_type);
+  RUN_TEST(test_out_of_range_values_are_refused);
+  RUN_TEST(test_unknown_read_only_and_hidden_names_are_refused);
+  RUN_TEST(test_network_changes_clear_the_fast_cache);
+  RUN_TEST(test_reset_mqtt_id);
+  RUN_TEST(test_command_sets_and_saves);
+  RUN_TEST(test_bad_command_shows_the_settings);
+  RUN_TEST(test_value_may_be_empty_or_hold_an_equals_sign);
+  RUN_TEST(test_reset_commands);
+  RUN_TEST(test_profile_command);
+  RUN_TEST(test_batch_detection);
+  RUN_TEST(test_group_commands);
+  RUN_TEST(test_trim);
+  RUN_TEST(test_json_batch);
+  RUN_TEST(test_json_batch_errors);
+  RUN_TEST(test_settings_complete);
+  RUN_TEST(test_pack_and_unpack);
+  RUN_TEST(test_full_length_strings_survive_packing);
+  RUN_TEST(test_unpack_skips_what_it_does_not_know);
+  RUN_TEST(test_unpack_stops_at_a_truncated_record);
+  return UNITY_END();
+  }
@@ -0,0 +1,114 @@
+/*
+ * Template substitution.
+ */
+#include <unity.h>
+
+#include "templates.h"
+#include "halStub.h"
+#include "firmwareStub.h"
+
+static int resolved; //resolver calls
+
+static void testResolver(Print& out, const char* key, const void* context)
+  {
+  resolved++;
+  if (strcmp(key,"id")==0)
+    out.print("unit7");
+  else if (strcmp(key,"n")==0)
+    out.print(*(const int*)context);
+  else if (strcmp(key,"sixteenletterkey")==0)
+    out.print("long");
+  }
+
+static char buf[100];
+
+void setUp()
+  {
+  resolved=0;
+  memset(buf,'x',sizeof(buf));
+  }
+
+void tearDown()
+  {
+  }
+
+void test_plain_text_is_copied()
+  {
+  TEST_ASSERT_EQUAL(14,renderTemplate(buf,sizeof(buf),"no fields here",testResolver,NULL));
+  TEST_ASSERT_EQUAL_STRING("no fields here",buf);
+  TEST_ASSERT_EQUAL(0,resolved);
+  }
+
+void test_fields_are_filled_in()
+  {
+  int n=42;
+  renderTemplate(buf,sizeof(buf),"{id} ran {n}s",testResolver,&n);
+  TEST_ASSERT_EQUAL_STRING("unit7 ran 42s",buf);
+  TEST_ASSERT_EQUAL(2,resolved);
+  }
+
+void test_unknown_key_comes_out_empty()
+  {
+  renderTemplate(buf,sizeof(buf),"[{nope}]",testResolver,NULL);
+  TEST_ASSERT_EQUAL_STRING("[]",buf);
+  }
+
+void test_stray_braces_are_copied()
+  {
+  renderTemplate(buf,sizeof(buf),"{} {id {{id}} }",testResolver,NULL);
+  TEST_ASSERT_EQUAL_STRING("{} {id {unit7} }",buf);
+  renderTemplate(buf,sizeof(buf),"open {id",testResolver,NULL);
+  TEST_ASSERT_EQUAL_STRING("open {id",buf);
+  }
+
+void test_key_length_limit()
+  {
+  renderTemplate(buf,sizeof(buf),"{sixteenletterkey}",testResolver,NULL); //TEMPLATE_KEY_SIZE exactly
+  TEST_ASSERT_EQUAL_STRING("long",buf);
+  renderTemplate(buf,sizeof(buf),"{eighteenletterskey}",testResolver,NULL);
+  TEST_ASSERT_EQUAL_STRING("{eighteenletterskey}",buf);
+  }
+
+void test_small_buffer_is_never_overrun()
+  {
+  char small[8];
+  TEST_ASSERT_EQUAL(7,renderTemplate(small,sizeof(small),"id is {id} here",testResolver,NULL));
+  TEST_ASSERT_EQUAL_STRING("id is u",small);
+  TEST_ASSERT_EQUAL(0,renderTemplate(buf,1,"anything",testResolver,NULL));
+  TEST_ASSERT_EQUAL(0,buf[0]);
+  TEST_ASSERT_EQUAL('x',buf[1]);
+  }
+
+void test_buffer_print_reports_overflow()
+  {
+  bufferPrint out(buf,6);
+  out.print("hello");
+  TEST_ASSERT_FALSE(out.overflowed());
+  out.print('!');
+  TEST_ASSERT_TRUE(out.overflowed());
+  TEST_ASSERT_EQUAL(5,out.length());
+  TEST_ASSERT_EQUAL_STRING("hello",buf);
+  }
+
+void test_print_and_flash_versions_match()
+  {
+  static const char tpl[] PROGMEM = "<{id}>";
+  Serial.output.clear();
+  renderTemplate(Serial,"<{id}>",testResolver,NULL);
+  renderTemplate_P(Serial,tpl,testResolver,NULL);
+  TEST_ASSERT_EQUAL_STRING("<unit7><unit7>",Serial.output.c_str());
+  }
+
+int main(int argc, char** argv)
+  {
+  UNITY_BEGIN();
+  RUN_TEST(test_plain_text_is_copied);
+  RUN_TEST(test_fields_are_filled_in);
+  RUN_TEST(test_unknown_key_comes_out_empty);
+  RUN_TEST(test_stray_braces_are_copied);
+  RUN_TEST(test_key_length_limit);
+  RUN_TEST(test_small_buffer_is_never_overrun);
+  RUN_TEST(test_buffer_print_reports_overflow);
+  RUN_TEST(test_print_and_flash_versions_match);
+  return UNITY_END();
+  }